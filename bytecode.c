@@ -0,0 +1,1804 @@
+#include "bytecode.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/* a .loxc file is a header, the global names the code refers to by index
+ * and then every function of the script. a nested function comes before
+ * the one that creates it, so the script itself is last:
+ *
+ *   header    "LOXC", version, OPCODE_COUNT, checksum, name count,
+ *             function count
+ *   name      string
+ *   function  arity, upvalue count, max slots, name string or NO_NAME,
+ *             cache count, method cache count, code size, code,
+ *             line run count, line runs, constant count, constants
+ *   constant  tag, then a double, a string or the index of a function
+ *   string    length, chars
+ *
+ * everything is a native endian uint32_t or padded to a multiple of four
+ * bytes so code and line runs can be used in place from the mapped file.
+ * the checksum is a CRC-32 of everything after it */
+
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 2
+#define NO_NAME UINT32_MAX
+
+typedef enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} constant_tag;
+
+typedef struct
+{
+    FILE *file;
+    int function_count;
+    bool ok;
+} writer_t;
+
+typedef struct
+{
+    uint8_t *at;
+    uint8_t *end;
+    const char *error;
+} reader_t;
+
+/* the functions of the file being loaded, nothing else refers to them
+ * until the script is returned */
+static _Thread_local value_array loading;
+
+static void
+write_u32(writer_t *writer, uint32_t value)
+{
+    fwrite(&value, sizeof(value), 1, writer->file);
+}
+
+/* CRC-32 of size bytes continuing from crc, a nibble at a time so the
+ * table stays small */
+static uint32_t
+checksum(const uint8_t *bytes, size_t size, uint32_t crc)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xf] ^ (crc >> 4);
+        crc = table[(crc ^ (bytes[i] >> 4)) & 0xf] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/* reads back what was written after the checksum at offset and fills it
+ * in. the file has to be open for reading as well */
+static void
+write_checksum(writer_t *writer, long offset)
+{
+    FILE *file = writer->file;
+    uint8_t buffer[4096];
+    uint32_t crc = 0;
+    size_t read;
+    fflush(file);
+    fseek(file, offset + 4, SEEK_SET);
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        crc = checksum(buffer, read, crc);
+    fseek(file, offset, SEEK_SET);
+    write_u32(writer, crc);
+}
+
+/* zeros up to the next multiple of four after size bytes */
+static void
+write_padding(writer_t *writer, size_t size)
+{
+    static const uint8_t padding[3];
+    fwrite(padding, 1, (4 - size % 4) % 4, writer->file);
+}
+
+static void
+write_padded(writer_t *writer, const void *bytes, size_t size)
+{
+    fwrite(bytes, 1, size, writer->file);
+    write_padding(writer, size);
+}
+
+static void
+write_string(writer_t *writer, obj_string *string)
+{
+    write_u32(writer, (uint32_t)string->length);
+    write_padded(writer, string->chars, (size_t)string->length);
+}
+
+static int
+count_functions(obj_function *function)
+{
+    int count = 1;
+    value_array *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+        if (is_function(constants->values[i]))
+            count += count_functions(as_function(constants->values[i]));
+    return count;
+}
+
+/* the code as the compiler left it, with any quickened op written back as
+ * the generic one */
+static void
+write_code(writer_t *writer, chunk_t *chunk)
+{
+    write_u32(writer, (uint32_t)chunk->count);
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instruction_length(chunk, offset);
+        fputc(unquickened_op(chunk->code[offset]), writer->file);
+        fwrite(&chunk->code[offset + 1], 1, length - 1, writer->file);
+        offset += length;
+    }
+    write_padding(writer, (size_t)chunk->count);
+
+    write_u32(writer, (uint32_t)chunk->line_count);
+    for (int i = 0; i < chunk->line_count; i++) {
+        write_u32(writer, (uint32_t)chunk->lines[i].offset);
+        write_u32(writer, (uint32_t)chunk->lines[i].line);
+    }
+}
+
+/* writes the functions function creates and then function itself */
+static void
+write_function(writer_t *writer, obj_function *function)
+{
+    chunk_t *chunk = &function->chunk;
+    int first = writer->function_count;
+    for (int i = 0; i < chunk->constants.count; i++)
+        if (is_function(chunk->constants.values[i]))
+            write_function(writer, as_function(chunk->constants.values[i]));
+
+    write_u32(writer, (uint32_t)function->arity);
+    write_u32(writer, (uint32_t)function->upvalue_count);
+    write_u32(writer, (uint32_t)function->max_slots);
+    if (function->name != NULL)
+        write_string(writer, function->name);
+    else
+        write_u32(writer, NO_NAME);
+    write_u32(writer, (uint32_t)chunk->cache_count);
+    write_u32(writer, (uint32_t)chunk->method_cache_count);
+    write_code(writer, chunk);
+
+    write_u32(writer, (uint32_t)chunk->constants.count);
+    int next = first;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        value_t constant = chunk->constants.values[i];
+        if (is_number(constant)) {
+            double number = as_number(constant);
+            write_u32(writer, CONSTANT_NUMBER);
+            write_padded(writer, &number, sizeof(number));
+        } else if (is_string(constant)) {
+            write_u32(writer, CONSTANT_STRING);
+            write_string(writer, as_string(constant));
+        } else if (is_function(constant)) {
+            next += count_functions(as_function(constant));
+            write_u32(writer, CONSTANT_FUNCTION);
+            write_u32(writer, (uint32_t)(next - 1));
+        } else {
+            fprintf(vm->err, "Can't write constant %d.\n", i);
+            writer->ok = false;
+        }
+    }
+    writer->function_count++;
+}
+
+/* writes script and everything it needs to path, the script must not have
+ * run yet */
+static bool
+write_bytecode(obj_function *script, const char *path)
+{
+    writer_t writer;
+    writer.file = fopen(path, "w+b");
+    writer.function_count = 0;
+    writer.ok = true;
+    if (writer.file == NULL) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    fwrite(BYTECODE_MAGIC, 1, 4, writer.file);
+    write_u32(&writer, BYTECODE_VERSION);
+    write_u32(&writer, OPCODE_COUNT);
+    long checksum_offset = ftell(writer.file);
+    write_u32(&writer, 0);
+    write_u32(&writer, (uint32_t)vm->global_names.count);
+    write_u32(&writer, (uint32_t)count_functions(script));
+    for (int i = 0; i < vm->global_names.count; i++)
+        write_string(&writer, as_string(vm->global_names.values[i]));
+    write_function(&writer, script);
+    write_checksum(&writer, checksum_offset);
+
+    if (ferror(writer.file) || fclose(writer.file) != 0) {
+        fprintf(vm->err, "Could not write file \"%s\".\n", path);
+        return false;
+    }
+    return writer.ok;
+}
+
+/* compiles source into a .loxc file at path, which is removed again if
+ * it couldn't be written completely */
+bool
+compile_bytecode(vm_t *context, const char *source, const char *path)
+{
+    vm_t *caller = vm;
+    vm = context;
+    bool compiled = false;
+    obj_function *function = compile(source);
+    if (function != NULL) {
+        push(obj_val((obj_t *)function));
+        compiled = write_bytecode(function, path);
+        if (!compiled)
+            remove(path);
+        pop();
+    }
+    vm = caller;
+    return compiled;
+}
+
+bool
+is_bytecode(const char *path)
+{
+    char magic[4];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    bool matches = fread(magic, 1, 4, file) == 4 &&
+                   memcmp(magic, BYTECODE_MAGIC, 4) == 0;
+    fclose(file);
+    return matches;
+}
+
+static bool
+invalid(reader_t *reader, const char *error)
+{
+    if (reader->error == NULL)
+        reader->error = error;
+    return false;
+}
+
+static bool
+read_u32(reader_t *reader, uint32_t *value)
+{
+    if (reader->end - reader->at < 4)
+        return invalid(reader, "unexpected end of file");
+    memcpy(value, reader->at, sizeof(*value));
+    reader->at += 4;
+    return true;
+}
+
+/* compares the checksum against the rest of the file, before anything in
+ * it is decoded */
+static bool
+read_checksum(reader_t *reader)
+{
+    uint32_t expected;
+    if (!read_u32(reader, &expected))
+        return false;
+    if (checksum(reader->at, (size_t)(reader->end - reader->at), 0) !=
+        expected)
+        return invalid(reader, "checksum mismatch");
+    return true;
+}
+
+/* a count of things taking at least size bytes each, checked against what
+ * is left of the file before anything is allocated for them */
+static bool
+read_count(reader_t *reader, uint32_t *count, size_t size)
+{
+    if (!read_u32(reader, count))
+        return false;
+    if (*count > (size_t)(reader->end - reader->at) / size)
+        return invalid(reader, "count past the end of file");
+    return true;
+}
+
+/* steps over size bytes and their padding, returning where they start */
+static uint8_t *
+read_bytes(reader_t *reader, uint32_t size)
+{
+    size_t padded = ((size_t)size + 3) & ~(size_t)3;
+    if ((size_t)(reader->end - reader->at) < padded) {
+        invalid(reader, "unexpected end of file");
+        return NULL;
+    }
+    uint8_t *bytes = reader->at;
+    reader->at += padded;
+    return bytes;
+}
+
+static obj_string *
+read_string(reader_t *reader, uint32_t length)
+{
+    if (length > INT32_MAX) {
+        invalid(reader, "string too long");
+        return NULL;
+    }
+    uint8_t *chars = read_bytes(reader, length);
+    if (chars == NULL)
+        return NULL;
+    return copy_string((const char *)chars, (int)length);
+}
+
+static int
+operand(uint8_t *code, bool wide)
+{
+    return wide ? code[0] << 8 | code[1] : code[0];
+}
+
+static bool
+is_name(chunk_t *chunk, int index)
+{
+    return index < chunk->constants.count &&
+           is_string(chunk->constants.values[index]);
+}
+
+/* checks every operand of the instruction at offset against the function
+ * and points global indices at this VM's slots */
+static bool
+check_instruction(reader_t *reader,
+                  obj_function *function,
+                  int offset,
+                  int *globals,
+                  int name_count)
+{
+    chunk_t *chunk = &function->chunk;
+    uint8_t *code = &chunk->code[offset];
+    uint8_t op = code[0];
+    int constants = chunk->constants.count;
+    bool valid = true;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            valid = operand(code + 1, op != OP_CONSTANT) < constants;
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG: {
+            bool wide = op == OP_GET_LOCAL_LONG || op == OP_SET_LOCAL_LONG;
+            valid = operand(code + 1, wide) < function->max_slots;
+            break;
+        }
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG: {
+            bool wide = op == OP_GET_UPVALUE_LONG || op == OP_SET_UPVALUE_LONG;
+            valid = operand(code + 1, wide) < function->upvalue_count;
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL: {
+            int index = operand(code + 1, true);
+            if (index >= name_count)
+                return invalid(reader, "global index out of range");
+            code[1] = (uint8_t)(globals[index] >> 8);
+            code[2] = (uint8_t)globals[index];
+            break;
+        }
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            valid = is_name(chunk, code[1]) &&
+                    operand(code + 2, true) < chunk->cache_count;
+            break;
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD:
+            valid = is_name(chunk, code[1]);
+            break;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+            valid = is_name(chunk, operand(code + 1, true));
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            valid = is_name(chunk, code[1]) &&
+                    operand(code + 3, true) < chunk->method_cache_count;
+            break;
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            valid = is_name(chunk, operand(code + 1, true)) &&
+                    operand(code + 4, true) < chunk->method_cache_count;
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            bool wide = op == OP_CLOSURE_LONG;
+            obj_function *closed =
+              as_function(chunk->constants.values[operand(code + 1, wide)]);
+            uint8_t *upvalue = code + (wide ? 3 : 2);
+            for (int i = 0; i < closed->upvalue_count; i++) {
+                int index = operand(upvalue + 1, wide);
+                if (upvalue[0] > 1 ||
+                    index >= (upvalue[0] ? function->max_slots
+                                         : function->upvalue_count))
+                    valid = false;
+                upvalue += wide ? 3 : 2;
+            }
+            break;
+        }
+        case OP_ADD_LOCAL_LOCAL:
+            valid = code[1] < function->max_slots &&
+                    code[2] < function->max_slots;
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            valid = code[1] < function->max_slots && code[2] < constants;
+            break;
+        default:
+            break;
+    }
+    return valid || invalid(reader, "operand out of range");
+}
+
+/* the offset a jump at offset goes to, -1 for other instructions */
+static int
+jump_target(chunk_t *chunk, int offset, int length)
+{
+    uint8_t *code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            return offset + length + operand(code + 1, true);
+        case OP_LOOP:
+            return offset + length - operand(code + 1, true);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return offset + length + operand(code + 3, true);
+        default:
+            return -1;
+    }
+}
+
+/* how many values the instruction at code takes off the stack and how many
+ * it puts back */
+static void
+stack_effect(uint8_t *code, int *pops, int *pushes)
+{
+    *pops = 0;
+    *pushes = 1;
+    switch (code[0]) {
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+            *pops = 1;
+            *pushes = 0;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            *pops = 1;
+            break;
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+            *pops = 2;
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            *pushes = 0;
+            break;
+        case OP_CALL:
+            *pops = code[1] + 1;
+            break;
+        case OP_INVOKE:
+            *pops = code[2] + 1;
+            break;
+        case OP_INVOKE_LONG:
+            *pops = code[3] + 1;
+            break;
+        case OP_SUPER_INVOKE:
+            *pops = code[2] + 2;
+            break;
+        case OP_SUPER_INVOKE_LONG:
+            *pops = code[3] + 2;
+            break;
+        default:
+            break;
+    }
+}
+
+/* depth is what the stack holds on the way into target, which has to be
+ * the same on every way in. the first way in queues target to be walked */
+static bool
+flow(reader_t *reader, int *depths, int *pending, int *pending_count,
+     int target, int depth)
+{
+    if (depths[target] == -2)
+        return invalid(reader, "jump into the middle of an instruction");
+    if (depths[target] == -1) {
+        depths[target] = depth;
+        pending[(*pending_count)++] = target;
+    }
+    if (depths[target] != depth)
+        return invalid(reader, "stack depth differs between paths");
+    return true;
+}
+
+/* run() trusts the code it is given, so every instruction of a loaded
+ * function has to decode to operands in range, no path can take more off
+ * the stack than is on it or grow it past the room call() leaves, every
+ * jump lands on an instruction and nothing falls off the end. the types
+ * of the values aren't tracked, so this doesn't make run() safe against
+ * crafted files. damaged ones are turned away by the checksum before */
+static bool
+check_code(reader_t *reader, obj_function *function, int *globals, int names)
+{
+    chunk_t *chunk = &function->chunk;
+    /* -2 inside an instruction, -1 not reached yet */
+    int *depths = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        depths[i] = -2;
+
+    bool valid = true;
+    for (int offset = 0; valid && offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        if (op >= OPCODE_COUNT || unquickened_op(op) != op) {
+            valid = invalid(reader, "unknown instruction");
+            break;
+        }
+        if (op == OP_CLOSURE || op == OP_CLOSURE_LONG) {
+            bool wide = op == OP_CLOSURE_LONG;
+            int constant = offset + (wide ? 2 : 1) < chunk->count
+                             ? operand(&chunk->code[offset + 1], wide)
+                             : chunk->constants.count;
+            if (constant >= chunk->constants.count ||
+                !is_function(chunk->constants.values[constant])) {
+                valid = invalid(reader, "closure of a non-function");
+                break;
+            }
+        }
+        int length = instruction_length(chunk, offset);
+        if (length > chunk->count - offset) {
+            valid = invalid(reader, "truncated instruction");
+            break;
+        }
+        depths[offset] = -1;
+        valid = check_instruction(reader, function, offset, globals, names);
+        offset += length;
+    }
+
+    /* then follow every path from the entry, each instruction is walked
+     * once with the depth it was first reached at */
+    int *pending = ALLOCATE(int, chunk->count);
+    int pending_count = 0;
+    if (valid) {
+        depths[0] = function->arity + 1;
+        pending[pending_count++] = 0;
+    }
+    int max_depth = function->max_slots + UINT8_COUNT;
+    while (valid && pending_count > 0) {
+        int offset = pending[--pending_count];
+        uint8_t *code = &chunk->code[offset];
+        int length = instruction_length(chunk, offset);
+        int depth = depths[offset];
+
+        int pops, pushes;
+        stack_effect(code, &pops, &pushes);
+        if (depth < pops) {
+            valid = invalid(reader, "stack underflow");
+            break;
+        }
+        depth += pushes - pops;
+        if (depth > max_depth) {
+            valid = invalid(reader, "stack overflow");
+            break;
+        }
+
+        int target = jump_target(chunk, offset, length);
+        if (target != -1) {
+            valid = target >= 0 && target < chunk->count
+                      ? flow(reader, depths, pending, &pending_count,
+                             target, depth)
+                      : invalid(reader, "jump out of the function");
+        }
+        if (!valid || code[0] == OP_RETURN || code[0] == OP_JUMP ||
+            code[0] == OP_LOOP)
+            continue;
+        valid = offset + length < chunk->count
+                  ? flow(reader, depths, pending, &pending_count,
+                         offset + length, depth)
+                  : invalid(reader, "code runs off the end");
+    }
+
+    FREE_ARRAY(int, pending, chunk->count);
+    FREE_ARRAY(int, depths, chunk->count);
+    return valid;
+}
+
+static bool
+read_lines(reader_t *reader, chunk_t *chunk)
+{
+    uint32_t count;
+    if (!read_count(reader, &count, sizeof(line_run_t)))
+        return false;
+    line_run_t *runs =
+      (line_run_t *)read_bytes(reader, count * sizeof(line_run_t));
+    if (runs == NULL)
+        return false;
+    if (count == 0 || runs[0].offset != 0)
+        return invalid(reader, "missing line table");
+    for (uint32_t i = 1; i < count; i++)
+        if (runs[i].offset <= runs[i - 1].offset ||
+            runs[i].offset >= chunk->count)
+            return invalid(reader, "line runs out of order");
+    chunk->lines = runs;
+    chunk->line_count = (int)count;
+    return true;
+}
+
+static bool
+read_constants(reader_t *reader, chunk_t *chunk)
+{
+    uint32_t count;
+    if (!read_count(reader, &count, 8))
+        return false;
+    if (count > UINT16_COUNT)
+        return invalid(reader, "too many constants");
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t tag;
+        if (!read_u32(reader, &tag))
+            return false;
+        switch (tag) {
+            case CONSTANT_NUMBER: {
+                uint8_t *bytes = read_bytes(reader, sizeof(double));
+                if (bytes == NULL)
+                    return false;
+                double number;
+                memcpy(&number, bytes, sizeof(number));
+                add_constant(chunk, number_val(number));
+                break;
+            }
+            case CONSTANT_STRING: {
+                uint32_t length;
+                if (!read_u32(reader, &length))
+                    return false;
+                obj_string *string = read_string(reader, length);
+                if (string == NULL)
+                    return false;
+                add_constant(chunk, obj_val((obj_t *)string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                /* the last one loaded is the function being read */
+                uint32_t index;
+                if (!read_u32(reader, &index))
+                    return false;
+                if (index >= (uint32_t)loading.count - 1)
+                    return invalid(reader, "function used before it is defined");
+                add_constant(chunk, loading.values[index]);
+                break;
+            }
+            default:
+                return invalid(reader, "unknown constant");
+        }
+    }
+    return true;
+}
+
+static obj_function *
+read_function(reader_t *reader, int *globals, int name_count)
+{
+    obj_function *function = newfunction();
+    push(obj_val((obj_t *)function));
+    write_value_array(&loading, obj_val((obj_t *)function));
+    pop();
+
+    uint32_t arity, upvalue_count, max_slots, name_length;
+    if (!read_u32(reader, &arity) || !read_u32(reader, &upvalue_count) ||
+        !read_u32(reader, &max_slots) || !read_u32(reader, &name_length))
+        return NULL;
+    if (arity > UINT8_MAX || upvalue_count > UINT16_COUNT ||
+        max_slots > UINT16_COUNT || max_slots <= arity) {
+        invalid(reader, "bad function header");
+        return NULL;
+    }
+    function->arity = (int)arity;
+    function->upvalue_count = (int)upvalue_count;
+    function->max_slots = (int)max_slots;
+    if (name_length != NO_NAME &&
+        (function->name = read_string(reader, name_length)) == NULL)
+        return NULL;
+
+    chunk_t *chunk = &function->chunk;
+    uint32_t cache_count, method_cache_count;
+    if (!read_u32(reader, &cache_count) ||
+        !read_u32(reader, &method_cache_count))
+        return NULL;
+    if (cache_count > UINT16_COUNT || method_cache_count > UINT16_COUNT) {
+        invalid(reader, "too many caches");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < cache_count; i++)
+        add_cache(chunk);
+    for (uint32_t i = 0; i < method_cache_count; i++)
+        add_method_cache(chunk);
+
+    /* the code stays where it is in the mapping, capacity 0 tells
+     * free_chunk it isn't ours */
+    uint32_t code_size;
+    if (!read_u32(reader, &code_size))
+        return NULL;
+    uint8_t *code = read_bytes(reader, code_size);
+    if (code == NULL || code_size > INT32_MAX)
+        return NULL;
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    chunk->code = code;
+    chunk->count = (int)code_size;
+    chunk->capacity = 0;
+
+    if (!read_lines(reader, chunk) || !read_constants(reader, chunk) ||
+        !check_code(reader, function, globals, name_count))
+        return NULL;
+    return function;
+}
+
+static obj_function *
+read_functions(reader_t *reader, uint32_t count, int *globals, int name_count)
+{
+    obj_function *function = NULL;
+    for (uint32_t i = 0; i < count; i++)
+        if ((function = read_function(reader, globals, name_count)) == NULL)
+            return NULL;
+    if (function == NULL || function->arity != 0 ||
+        function->upvalue_count != 0) {
+        invalid(reader, "no script");
+        return NULL;
+    }
+    if (reader->at != reader->end) {
+        invalid(reader, "trailing bytes");
+        return NULL;
+    }
+    return function;
+}
+
+static obj_function *
+read_script(reader_t *reader)
+{
+    uint8_t *magic = read_bytes(reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0) {
+        invalid(reader, "not a bytecode file");
+        return NULL;
+    }
+    uint32_t version, opcode_count, name_count, function_count;
+    if (!read_u32(reader, &version) || !read_u32(reader, &opcode_count))
+        return NULL;
+    if (version != BYTECODE_VERSION || opcode_count != OPCODE_COUNT) {
+        invalid(reader, "written by a different version of lox");
+        return NULL;
+    }
+    if (!read_checksum(reader))
+        return NULL;
+    if (!read_count(reader, &name_count, 4) ||
+        !read_count(reader, &function_count, 4))
+        return NULL;
+
+    /* the index each name has in this VM, which is what the code gets
+     * rewritten to use */
+    int *globals = ALLOCATE(int, name_count);
+    uint32_t i;
+    for (i = 0; i < name_count; i++) {
+        uint32_t length;
+        if (!read_u32(reader, &length))
+            break;
+        obj_string *name = read_string(reader, length);
+        if (name == NULL)
+            break;
+        globals[i] = global_index(name);
+        if (globals[i] > UINT16_MAX) {
+            invalid(reader, "too many globals");
+            break;
+        }
+    }
+    obj_function *script = NULL;
+    if (i == name_count)
+        script =
+          read_functions(reader, function_count, globals, (int)name_count);
+    FREE_ARRAY(int, globals, name_count);
+    return script;
+}
+
+/* maps the file at path copy on write for reader, the code in it gets
+ * patched and quickened in place. the mapping stays until free_bytecode */
+static bool
+map_file(const char *path, reader_t *reader)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    void *start = size > 0 ? mmap(NULL,
+                                  size,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE,
+                                  fd,
+                                  0)
+                           : MAP_FAILED;
+    close(fd);
+    if (start == MAP_FAILED) {
+        fprintf(vm->err, "Could not read file \"%s\".\n", path);
+        return false;
+    }
+
+    if (vm->mapping_capacity < vm->mapping_count + 1) {
+        int old_capacity = vm->mapping_capacity;
+        vm->mapping_capacity = grow_capacity(old_capacity);
+        vm->mappings = GROW_ARRAY(
+          mapping_t, vm->mappings, old_capacity, vm->mapping_capacity);
+    }
+    vm->mappings[vm->mapping_count].start = start;
+    vm->mappings[vm->mapping_count].size = size;
+    vm->mapping_count++;
+
+    reader->at = start;
+    reader->end = (uint8_t *)start + size;
+    reader->error = NULL;
+    return true;
+}
+
+/* loads the script in the .loxc file at path, NULL with a message when it
+ * can't be read or doesn't pass validation */
+obj_function *
+load_bytecode(const char *path)
+{
+    reader_t reader;
+    if (!map_file(path, &reader))
+        return NULL;
+    obj_function *script = read_script(&reader);
+    free_value_array(&loading);
+    if (script == NULL)
+        fprintf(vm->err, "Invalid bytecode file \"%s\": %s.\n", path,
+                reader.error);
+    return script;
+}
+
+/* a heap image is every object reachable from the globals, written once a
+ * script has run so a later process can start from where it left off:
+ *
+ *   header   "LXIM", version, OPCODE_COUNT, checksum, object count,
+ *            global count
+ *   object   type, payload size, payload as laid out in write_object
+ *   global   name, value
+ *   value    tag, then a double or an object
+ *
+ * objects refer to each other by index, NO_OBJECT standing in for NULL.
+ * loading takes two passes over the objects, the first creates an empty
+ * one for each index and the second fills them in, so references can go
+ * either way. functions keep their code in the mapped file like .loxc and
+ * the checksum covers what follows it the same way */
+
+#define IMAGE_MAGIC "LXIM"
+#define IMAGE_VERSION 2
+#define NO_OBJECT UINT32_MAX
+
+typedef enum
+{
+    IMAGE_NIL,
+    IMAGE_FALSE,
+    IMAGE_TRUE,
+    IMAGE_NUMBER,
+    IMAGE_OBJECT,
+    IMAGE_UNDEFINED,
+} value_tag;
+
+typedef struct
+{
+    obj_t *object;
+    uint32_t index;
+} object_slot_t;
+
+/* the objects going into an image in the order they are written, and a
+ * map from each of them to its index */
+typedef struct
+{
+    writer_t writer;
+    int count;
+    int capacity;
+    obj_t **objects;
+    int slot_capacity;
+    object_slot_t *slots;
+} image_t;
+
+static object_slot_t *
+find_object_slot(object_slot_t *slots, int capacity, obj_t *object)
+{
+    uint32_t index = (uint32_t)((uintptr_t)object >> 3) * 2654435761u;
+    for (index &= capacity - 1;; index = (index + 1) & (capacity - 1))
+        if (slots[index].object == NULL || slots[index].object == object)
+            return &slots[index];
+}
+
+/* the index object has in the image, the first time it is seen it gets
+ * the next one and is queued to be written */
+static uint32_t
+object_index(image_t *image, obj_t *object)
+{
+    if (object == NULL)
+        return NO_OBJECT;
+
+    if (image->slot_capacity < (image->count + 1) * 2) {
+        int capacity = image->slot_capacity < 8 ? 16 : image->slot_capacity * 2;
+        object_slot_t *slots = ALLOCATE(object_slot_t, capacity);
+        for (int i = 0; i < capacity; i++)
+            slots[i].object = NULL;
+        for (int i = 0; i < image->slot_capacity; i++)
+            if (image->slots[i].object != NULL)
+                *find_object_slot(slots, capacity, image->slots[i].object) =
+                  image->slots[i];
+        FREE_ARRAY(object_slot_t, image->slots, image->slot_capacity);
+        image->slots = slots;
+        image->slot_capacity = capacity;
+    }
+
+    object_slot_t *slot =
+      find_object_slot(image->slots, image->slot_capacity, object);
+    if (slot->object == NULL) {
+        if (image->capacity < image->count + 1) {
+            int old_capacity = image->capacity;
+            image->capacity = grow_capacity(old_capacity);
+            image->objects = GROW_ARRAY(
+              obj_t *, image->objects, old_capacity, image->capacity);
+        }
+        slot->object = object;
+        slot->index = (uint32_t)image->count;
+        image->objects[image->count++] = object;
+    }
+    return slot->index;
+}
+
+static void
+see_value(image_t *image, value_t value)
+{
+    if (is_obj(value))
+        object_index(image, as_obj(value));
+}
+
+static void
+see_table(image_t *image, table_t *table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) {
+            object_index(image, (obj_t *)table->entries[i].key);
+            see_value(image, table->entries[i].value);
+        }
+    }
+}
+
+/* queues everything object refers to, the same references write_object
+ * writes */
+static void
+see_references(image_t *image, obj_t *object)
+{
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method *bound = (obj_bound_method *)object;
+            see_value(image, bound->receiver);
+            object_index(image, (obj_t *)bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            obj_class *class = (obj_class *)object;
+            object_index(image, (obj_t *)class->name);
+            object_index(image, (obj_t *)class->root_shape);
+            see_table(image, &class->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            obj_closure *closure = (obj_closure *)object;
+            object_index(image, (obj_t *)closure->function);
+            for (int i = 0; i < closure->upvalue_count; i++)
+                object_index(image, (obj_t *)closure->upvalues[i]);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_function *function = (obj_function *)object;
+            object_index(image, (obj_t *)function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++)
+                see_value(image, function->chunk.constants.values[i]);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            obj_instance *instance = (obj_instance *)object;
+            object_index(image, (obj_t *)instance->class);
+            object_index(image, (obj_t *)instance->shape);
+            if (instance->shape == NULL) {
+                see_table(image, instance->dictionary);
+                break;
+            }
+            for (int i = 0; i < instance->shape->slot_count; i++)
+                see_value(image, instance->fields[i]);
+            break;
+        }
+        case OBJ_SHAPE: {
+            obj_shape *shape = (obj_shape *)object;
+            object_index(image, (obj_t *)shape->parent);
+            object_index(image, (obj_t *)shape->key);
+            see_table(image, &shape->transitions);
+            break;
+        }
+        case OBJ_UPVALUE:
+            see_value(image, *((obj_upvalue *)object)->location);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+static void
+write_reference(image_t *image, void *object)
+{
+    write_u32(&image->writer, object_index(image, (obj_t *)object));
+}
+
+static void
+write_value(image_t *image, value_t value)
+{
+    writer_t *writer = &image->writer;
+    if (is_number(value)) {
+        double number = as_number(value);
+        write_u32(writer, IMAGE_NUMBER);
+        write_padded(writer, &number, sizeof(number));
+    } else if (is_obj(value)) {
+        write_u32(writer, IMAGE_OBJECT);
+        write_reference(image, as_obj(value));
+    } else if (is_nil(value))
+        write_u32(writer, IMAGE_NIL);
+    else if (is_bool(value))
+        write_u32(writer, as_bool(value) ? IMAGE_TRUE : IMAGE_FALSE);
+    else
+        write_u32(writer, IMAGE_UNDEFINED);
+}
+
+static void
+write_table(image_t *image, table_t *table)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; i++)
+        if (table->entries[i].key != NULL)
+            count++;
+    write_u32(&image->writer, count);
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) {
+            write_reference(image, table->entries[i].key);
+            write_value(image, table->entries[i].value);
+        }
+    }
+}
+
+static void
+write_object(image_t *image, obj_t *object)
+{
+    writer_t *writer = &image->writer;
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            /* receiver, method */
+            obj_bound_method *bound = (obj_bound_method *)object;
+            write_value(image, bound->receiver);
+            write_reference(image, bound->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            /* name, version, root shape, field hint, methods */
+            obj_class *class = (obj_class *)object;
+            write_reference(image, class->name);
+            write_u32(writer, class->version);
+            write_reference(image, class->root_shape);
+            write_u32(writer, (uint32_t)class->field_hint);
+            write_table(image, &class->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            /* function, upvalue count, upvalues */
+            obj_closure *closure = (obj_closure *)object;
+            write_reference(image, closure->function);
+            write_u32(writer, (uint32_t)closure->upvalue_count);
+            for (int i = 0; i < closure->upvalue_count; i++)
+                write_reference(image, closure->upvalues[i]);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            /* arity, upvalue count, max slots, name, cache count, method
+             * cache count, code, line runs, constant count, constants */
+            obj_function *function = (obj_function *)object;
+            chunk_t *chunk = &function->chunk;
+            write_u32(writer, (uint32_t)function->arity);
+            write_u32(writer, (uint32_t)function->upvalue_count);
+            write_u32(writer, (uint32_t)function->max_slots);
+            write_reference(image, function->name);
+            write_u32(writer, (uint32_t)chunk->cache_count);
+            write_u32(writer, (uint32_t)chunk->method_cache_count);
+            write_code(writer, chunk);
+            write_u32(writer, (uint32_t)chunk->constants.count);
+            for (int i = 0; i < chunk->constants.count; i++)
+                write_value(image, chunk->constants.values[i]);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            /* class, shape, then the fields in slot order or, without a
+             * shape, the dictionary */
+            obj_instance *instance = (obj_instance *)object;
+            write_reference(image, instance->class);
+            write_reference(image, instance->shape);
+            if (instance->shape == NULL) {
+                write_table(image, instance->dictionary);
+                break;
+            }
+            write_u32(writer, (uint32_t)instance->shape->slot_count);
+            for (int i = 0; i < instance->shape->slot_count; i++)
+                write_value(image, instance->fields[i]);
+            break;
+        }
+        case OBJ_NATIVE: {
+            /* the name it is registered under */
+            const char *name = native_name(((obj_native *)object)->function);
+            if (name == NULL) {
+                fprintf(vm->err, "Can't write an unregistered native.\n");
+                writer->ok = false;
+                name = "";
+            }
+            write_u32(writer, (uint32_t)strlen(name));
+            write_padded(writer, name, strlen(name));
+            break;
+        }
+        case OBJ_SHAPE: {
+            /* parent, key, slot count, transitions */
+            obj_shape *shape = (obj_shape *)object;
+            write_reference(image, shape->parent);
+            write_reference(image, shape->key);
+            write_u32(writer, (uint32_t)shape->slot_count);
+            write_table(image, &shape->transitions);
+            break;
+        }
+        case OBJ_STRING:
+            write_string(writer, (obj_string *)object);
+            break;
+        case OBJ_UPVALUE:
+            /* the closed over value */
+            write_value(image, *((obj_upvalue *)object)->location);
+            break;
+    }
+}
+
+static bool
+write_heap(const char *path)
+{
+    image_t image;
+    image.writer.file = fopen(path, "w+b");
+    image.writer.function_count = 0;
+    image.writer.ok = true;
+    image.count = 0;
+    image.capacity = 0;
+    image.objects = NULL;
+    image.slot_capacity = 0;
+    image.slots = NULL;
+    if (image.writer.file == NULL) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    FILE *file = image.writer.file;
+
+    for (int i = 0; i < vm->globals.count; i++) {
+        see_value(&image, vm->global_names.values[i]);
+        see_value(&image, vm->globals.values[i]);
+    }
+    for (int i = 0; i < image.count; i++)
+        see_references(&image, image.objects[i]);
+
+    fwrite(IMAGE_MAGIC, 1, 4, file);
+    write_u32(&image.writer, IMAGE_VERSION);
+    write_u32(&image.writer, OPCODE_COUNT);
+    long checksum_offset = ftell(file);
+    write_u32(&image.writer, 0);
+    write_u32(&image.writer, (uint32_t)image.count);
+    write_u32(&image.writer, (uint32_t)vm->globals.count);
+
+    for (int i = 0; i < image.count; i++) {
+        write_u32(&image.writer, image.objects[i]->type);
+        write_u32(&image.writer, 0);
+        long start = ftell(file);
+        write_object(&image, image.objects[i]);
+        long end = ftell(file);
+        fseek(file, start - 4, SEEK_SET);
+        write_u32(&image.writer, (uint32_t)(end - start));
+        fseek(file, end, SEEK_SET);
+    }
+
+    for (int i = 0; i < vm->globals.count; i++) {
+        write_reference(&image, as_obj(vm->global_names.values[i]));
+        write_value(&image, vm->globals.values[i]);
+    }
+    write_checksum(&image.writer, checksum_offset);
+
+    FREE_ARRAY(obj_t *, image.objects, image.capacity);
+    FREE_ARRAY(object_slot_t, image.slots, image.slot_capacity);
+    if (ferror(file) || fclose(file) != 0) {
+        fprintf(vm->err, "Could not write file \"%s\".\n", path);
+        return false;
+    }
+    return image.writer.ok;
+}
+
+/* the object at the index read, which has to be a type one. NULL when
+ * optional allows NO_OBJECT */
+static bool
+read_reference(reader_t *reader,
+               obj_type_t type,
+               bool optional,
+               obj_t **object)
+{
+    uint32_t index;
+    if (!read_u32(reader, &index))
+        return false;
+    if (index == NO_OBJECT && optional) {
+        *object = NULL;
+        return true;
+    }
+    if (index >= (uint32_t)loading.count)
+        return invalid(reader, "object index out of range");
+    obj_t *found = as_obj(loading.values[index]);
+    if (found->type != type)
+        return invalid(reader, "object of the wrong type");
+    *object = found;
+    return true;
+}
+
+static bool
+read_value(reader_t *reader, value_t *value)
+{
+    uint32_t tag;
+    if (!read_u32(reader, &tag))
+        return false;
+    switch (tag) {
+        case IMAGE_NIL:
+            *value = nil_val();
+            return true;
+        case IMAGE_FALSE:
+        case IMAGE_TRUE:
+            *value = bool_val(tag == IMAGE_TRUE);
+            return true;
+        case IMAGE_UNDEFINED:
+            *value = undefined_val();
+            return true;
+        case IMAGE_NUMBER: {
+            uint8_t *bytes = read_bytes(reader, sizeof(double));
+            if (bytes == NULL)
+                return false;
+            double number;
+            memcpy(&number, bytes, sizeof(number));
+            *value = number_val(number);
+            return true;
+        }
+        case IMAGE_OBJECT: {
+            uint32_t index;
+            if (!read_u32(reader, &index))
+                return false;
+            if (index >= (uint32_t)loading.count)
+                return invalid(reader, "object index out of range");
+            obj_t *object = as_obj(loading.values[index]);
+            /* shapes and upvalues are never values scripts can see */
+            if (object->type == OBJ_SHAPE || object->type == OBJ_UPVALUE)
+                return invalid(reader, "object of the wrong type");
+            *value = obj_val(object);
+            return true;
+        }
+        default:
+            return invalid(reader, "unknown value");
+    }
+}
+
+/* fills table from count key, value pairs. the values are any value for
+ * OBJ_STRING, otherwise objects of value_type */
+static bool
+read_table(reader_t *reader, table_t *table, obj_type_t value_type)
+{
+    uint32_t count;
+    if (!read_count(reader, &count, 8))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        obj_t *key;
+        if (!read_reference(reader, OBJ_STRING, false, &key))
+            return false;
+
+        value_t value;
+        if (value_type == OBJ_STRING) {
+            if (!read_value(reader, &value))
+                return false;
+        } else {
+            uint32_t tag;
+            obj_t *object;
+            if (!read_u32(reader, &tag))
+                return false;
+            if (tag != IMAGE_OBJECT)
+                return invalid(reader, "object of the wrong type");
+            if (!read_reference(reader, value_type, false, &object))
+                return false;
+            value = obj_val(object);
+        }
+        table_set(table, (obj_string *)key, value);
+    }
+    return true;
+}
+
+/* the first pass: an object of type that is safe for the GC to trace,
+ * with only what later objects need to be created already filled in */
+static obj_t *
+new_shell(reader_t *reader, uint32_t type)
+{
+    switch (type) {
+        case OBJ_BOUND_METHOD:
+            return (obj_t *)newbound_method(nil_val(), NULL);
+        case OBJ_CLASS:
+            return (obj_t *)newclass(NULL);
+        case OBJ_CLOSURE: {
+            uint32_t function, upvalue_count;
+            if (!read_u32(reader, &function) ||
+                !read_count(reader, &upvalue_count, 4))
+                return NULL;
+            obj_upvalue **upvalues = ALLOCATE(obj_upvalue *, upvalue_count);
+            for (uint32_t i = 0; i < upvalue_count; i++)
+                upvalues[i] = NULL;
+            obj_closure *closure = ALLOCATE_OBJ(obj_closure, OBJ_CLOSURE);
+            closure->function = NULL;
+            closure->upvalues = upvalues;
+            closure->upvalue_count = (int)upvalue_count;
+            return (obj_t *)closure;
+        }
+        case OBJ_FUNCTION: {
+            uint32_t arity, upvalue_count, max_slots;
+            if (!read_u32(reader, &arity) ||
+                !read_u32(reader, &upvalue_count) ||
+                !read_u32(reader, &max_slots))
+                return NULL;
+            if (arity > UINT8_MAX || upvalue_count > UINT16_COUNT ||
+                max_slots > UINT16_COUNT || max_slots <= arity) {
+                invalid(reader, "bad function header");
+                return NULL;
+            }
+            obj_function *function = newfunction();
+            function->arity = (int)arity;
+            function->upvalue_count = (int)upvalue_count;
+            function->max_slots = (int)max_slots;
+            return (obj_t *)function;
+        }
+        case OBJ_INSTANCE: {
+            /* an empty dictionary until the second pass */
+            table_t *dictionary = ALLOCATE(table_t, 1);
+            table_init(dictionary);
+            obj_instance *instance = ALLOCATE_OBJ(obj_instance, OBJ_INSTANCE);
+            instance->class = NULL;
+            instance->shape = NULL;
+            instance->field_capacity = 0;
+            instance->fields = NULL;
+            instance->dictionary = dictionary;
+            return (obj_t *)instance;
+        }
+        case OBJ_NATIVE: {
+            uint32_t length;
+            if (!read_u32(reader, &length))
+                return NULL;
+            uint8_t *name = read_bytes(reader, length);
+            if (name == NULL)
+                return NULL;
+            native_fn function = find_native((const char *)name, (int)length);
+            if (function == NULL) {
+                invalid(reader, "unknown native");
+                return NULL;
+            }
+            return (obj_t *)newnative(function);
+        }
+        case OBJ_SHAPE: {
+            /* instances need the slot count to know how many fields to
+             * trace before the shape itself is filled in */
+            uint32_t parent, key, slot_count;
+            if (!read_u32(reader, &parent) || !read_u32(reader, &key) ||
+                !read_u32(reader, &slot_count))
+                return NULL;
+            if (slot_count > SHAPE_MAX_FIELDS) {
+                invalid(reader, "too many fields");
+                return NULL;
+            }
+            obj_shape *shape = newshape(NULL, NULL);
+            shape->slot_count = (int)slot_count;
+            return (obj_t *)shape;
+        }
+        case OBJ_STRING: {
+            uint32_t length;
+            if (!read_u32(reader, &length))
+                return NULL;
+            return (obj_t *)read_string(reader, length);
+        }
+        case OBJ_UPVALUE: {
+            obj_upvalue *upvalue = newupvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            return (obj_t *)upvalue;
+        }
+        default:
+            invalid(reader, "unknown object type");
+            return NULL;
+    }
+}
+
+static bool
+fill_function(reader_t *reader,
+              obj_function *function,
+              int *globals,
+              int global_count)
+{
+    chunk_t *chunk = &function->chunk;
+    uint32_t header[3], cache_count, method_cache_count, code_size;
+    obj_t *name;
+    if (!read_u32(reader, &header[0]) || !read_u32(reader, &header[1]) ||
+        !read_u32(reader, &header[2]) ||
+        !read_reference(reader, OBJ_STRING, true, &name) ||
+        !read_u32(reader, &cache_count) ||
+        !read_u32(reader, &method_cache_count) ||
+        !read_u32(reader, &code_size))
+        return false;
+    function->name = (obj_string *)name;
+    if (cache_count > UINT16_COUNT || method_cache_count > UINT16_COUNT)
+        return invalid(reader, "too many caches");
+    for (uint32_t i = 0; i < cache_count; i++)
+        add_cache(chunk);
+    for (uint32_t i = 0; i < method_cache_count; i++)
+        add_method_cache(chunk);
+
+    uint8_t *code = read_bytes(reader, code_size);
+    if (code == NULL || code_size > INT32_MAX)
+        return false;
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    chunk->code = code;
+    chunk->count = (int)code_size;
+    chunk->capacity = 0;
+    if (!read_lines(reader, chunk))
+        return false;
+
+    uint32_t constant_count;
+    if (!read_count(reader, &constant_count, 4))
+        return false;
+    if (constant_count > UINT16_COUNT)
+        return invalid(reader, "too many constants");
+    for (uint32_t i = 0; i < constant_count; i++) {
+        value_t constant;
+        if (!read_value(reader, &constant))
+            return false;
+        add_constant(chunk, constant);
+    }
+    return check_code(reader, function, globals, global_count);
+}
+
+/* the second pass: everything the shell of object refers to */
+static bool
+fill_object(reader_t *reader, obj_t *object, int *globals, int global_count)
+{
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method *bound = (obj_bound_method *)object;
+            obj_t *method;
+            if (!read_value(reader, &bound->receiver) ||
+                !read_reference(reader, OBJ_CLOSURE, false, &method))
+                return false;
+            bound->method = (obj_closure *)method;
+            return true;
+        }
+        case OBJ_CLASS: {
+            obj_class *class = (obj_class *)object;
+            uint32_t version, field_hint;
+            obj_t *name, *root_shape;
+            if (!read_reference(reader, OBJ_STRING, false, &name) ||
+                !read_u32(reader, &version) ||
+                !read_reference(reader, OBJ_SHAPE, true, &root_shape) ||
+                !read_u32(reader, &field_hint))
+                return false;
+            if (field_hint > SHAPE_MAX_FIELDS)
+                return invalid(reader, "bad field hint");
+            class->name = (obj_string *)name;
+            class->root_shape = (obj_shape *)root_shape;
+            class->version = version;
+            class->field_hint = (int)field_hint;
+            return read_table(reader, &class->methods, OBJ_CLOSURE);
+        }
+        case OBJ_CLOSURE: {
+            obj_closure *closure = (obj_closure *)object;
+            obj_t *function;
+            uint32_t upvalue_count;
+            if (!read_reference(reader, OBJ_FUNCTION, false, &function) ||
+                !read_u32(reader, &upvalue_count))
+                return false;
+            if ((int)upvalue_count !=
+                ((obj_function *)function)->upvalue_count)
+                return invalid(reader, "closure doesn't fit its function");
+            closure->function = (obj_function *)function;
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                obj_t *upvalue;
+                if (!read_reference(reader, OBJ_UPVALUE, false, &upvalue))
+                    return false;
+                closure->upvalues[i] = (obj_upvalue *)upvalue;
+            }
+            return true;
+        }
+        case OBJ_FUNCTION:
+            return fill_function(
+              reader, (obj_function *)object, globals, global_count);
+        case OBJ_INSTANCE: {
+            obj_instance *instance = (obj_instance *)object;
+            obj_t *class, *found;
+            if (!read_reference(reader, OBJ_CLASS, false, &class) ||
+                !read_reference(reader, OBJ_SHAPE, true, &found))
+                return false;
+            instance->class = (obj_class *)class;
+            obj_shape *shape = (obj_shape *)found;
+            if (shape == NULL)
+                return read_table(reader, instance->dictionary, OBJ_STRING);
+
+            uint32_t count;
+            if (!read_count(reader, &count, 4))
+                return false;
+            if ((int)count != shape->slot_count)
+                return invalid(reader, "fields don't fit the shape");
+            value_t *fields = ALLOCATE(value_t, count);
+            for (uint32_t i = 0; i < count; i++) {
+                if (!read_value(reader, &fields[i])) {
+                    FREE_ARRAY(value_t, fields, count);
+                    return false;
+                }
+            }
+            table_free(instance->dictionary);
+            FREE(table_t, instance->dictionary);
+            instance->dictionary = NULL;
+            instance->fields = fields;
+            instance->field_capacity = (int)count;
+            instance->shape = shape;
+            return true;
+        }
+        case OBJ_SHAPE: {
+            obj_shape *shape = (obj_shape *)object;
+            uint32_t slot_count;
+            obj_t *parent, *key;
+            if (!read_reference(reader, OBJ_SHAPE, true, &parent) ||
+                !read_reference(reader, OBJ_STRING, true, &key) ||
+                !read_u32(reader, &slot_count))
+                return false;
+            shape->parent = (obj_shape *)parent;
+            shape->key = (obj_string *)key;
+            return read_table(reader, &shape->transitions, OBJ_SHAPE);
+        }
+        case OBJ_UPVALUE:
+            return read_value(reader, &((obj_upvalue *)object)->closed);
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            /* complete from the first pass */
+            reader->at = reader->end;
+            return true;
+    }
+    return true;
+}
+
+/* what the second pass can't check one object at a time: shapes have to
+ * form trees, each child one slot past its parent */
+static bool
+check_shapes(reader_t *reader)
+{
+    for (int i = 0; i < loading.count; i++) {
+        obj_t *object = as_obj(loading.values[i]);
+        if (object->type == OBJ_SHAPE) {
+            obj_shape *shape = (obj_shape *)object;
+            if ((shape->parent == NULL) != (shape->key == NULL) ||
+                shape->slot_count !=
+                  (shape->parent != NULL ? shape->parent->slot_count + 1 : 0))
+                return invalid(reader, "broken shape tree");
+            table_t *transitions = &shape->transitions;
+            for (int j = 0; j < transitions->capacity; j++) {
+                entry_t *entry = &transitions->entries[j];
+                if (entry->key != NULL &&
+                    (((obj_shape *)as_obj(entry->value))->parent != shape ||
+                     ((obj_shape *)as_obj(entry->value))->key != entry->key))
+                    return invalid(reader, "broken shape tree");
+            }
+        } else if (object->type == OBJ_CLASS) {
+            obj_class *class = (obj_class *)object;
+            if (class->root_shape != NULL && class->root_shape->key != NULL)
+                return invalid(reader, "broken shape tree");
+        }
+    }
+    return true;
+}
+
+/* the globals section, names are bound to this VM's slots while checking
+ * and values only set once the whole image has passed */
+static bool
+read_globals(reader_t *reader, int *globals, uint32_t count, bool set)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        obj_t *name;
+        value_t value;
+        if (!read_reference(reader, OBJ_STRING, false, &name) ||
+            !read_value(reader, &value))
+            return false;
+        if (set) {
+            vm->globals.values[globals[i]] = value;
+            continue;
+        }
+        globals[i] = global_index((obj_string *)name);
+        if (globals[i] > UINT16_MAX)
+            return invalid(reader, "too many globals");
+    }
+    return true;
+}
+
+static bool
+read_image(reader_t *reader)
+{
+    uint8_t *magic = read_bytes(reader, 4);
+    if (magic == NULL || memcmp(magic, IMAGE_MAGIC, 4) != 0)
+        return invalid(reader, "not an image file");
+    uint32_t version, opcode_count, object_count, global_count;
+    if (!read_u32(reader, &version) || !read_u32(reader, &opcode_count))
+        return false;
+    if (version != IMAGE_VERSION || opcode_count != OPCODE_COUNT)
+        return invalid(reader, "written by a different version of lox");
+    if (!read_checksum(reader))
+        return false;
+    if (!read_count(reader, &object_count, 8) ||
+        !read_count(reader, &global_count, 8))
+        return false;
+
+    uint8_t *objects = reader->at;
+    for (uint32_t i = 0; i < object_count; i++) {
+        uint32_t type, size;
+        if (!read_u32(reader, &type) || !read_u32(reader, &size))
+            return false;
+        reader_t payload = { reader->at, NULL, NULL };
+        if (read_bytes(reader, size) == NULL)
+            return false;
+        payload.end = payload.at + size;
+        obj_t *shell = new_shell(&payload, type);
+        if (shell == NULL)
+            return invalid(reader, payload.error);
+        push(obj_val(shell));
+        write_value_array(&loading, obj_val(shell));
+        pop();
+    }
+
+    uint8_t *global_section = reader->at;
+    int *globals = ALLOCATE(int, global_count);
+    bool valid = read_globals(reader, globals, global_count, false);
+    if (valid && reader->at != reader->end)
+        valid = invalid(reader, "trailing bytes");
+
+    reader->at = objects;
+    for (int i = 0; valid && i < loading.count; i++) {
+        uint32_t size = 0;
+        reader->at += 4;
+        read_u32(reader, &size);
+        reader_t payload = { reader->at, reader->at + size, NULL };
+        read_bytes(reader, size);
+        if (!fill_object(&payload,
+                         as_obj(loading.values[i]),
+                         globals,
+                         (int)global_count) ||
+            payload.at != payload.end)
+            valid = invalid(reader,
+                            payload.error != NULL ? payload.error
+                                                  : "object size mismatch");
+    }
+    valid = valid && check_shapes(reader);
+
+    if (valid) {
+        reader->at = global_section;
+        read_globals(reader, globals, global_count, true);
+    }
+    FREE_ARRAY(int, globals, global_count);
+    return valid;
+}
+
+/* writes the globals of context and everything reachable from them to
+ * path. only between scripts, a running one would have state on the stack
+ * that isn't in the image */
+bool
+write_image(vm_t *context, const char *path)
+{
+    vm_t *caller = vm;
+    vm = context;
+    bool written = write_heap(path);
+    vm = caller;
+    return written;
+}
+
+/* restores the globals and everything they refer to from the image at
+ * path into context, false with a message when it can't be read or
+ * doesn't pass validation */
+bool
+load_image(vm_t *context, const char *path)
+{
+    vm_t *caller = vm;
+    vm = context;
+    reader_t reader;
+    bool loaded = map_file(path, &reader);
+    if (loaded) {
+        loaded = read_image(&reader);
+        free_value_array(&loading);
+        if (!loaded)
+            fprintf(vm->err, "Invalid image file \"%s\": %s.\n", path,
+                    reader.error);
+    }
+    vm = caller;
+    return loaded;
+}
+
+void
+mark_bytecode_roots(void)
+{
+    for (int i = 0; i < loading.count; i++)
+        mark_value(loading.values[i]);
+}
+
+void
+forward_bytecode_roots(void)
+{
+    for (int i = 0; i < loading.count; i++)
+        forward_value(&loading.values[i]);
+}
+
+/* after the objects are gone, nothing points into the mappings anymore */
+void
+free_bytecode(void)
+{
+    for (int i = 0; i < vm->mapping_count; i++)
+        munmap(vm->mappings[i].start, vm->mappings[i].size);
+    FREE_ARRAY(mapping_t, vm->mappings, vm->mapping_capacity);
+    vm->mapping_count = 0;
+    vm->mapping_capacity = 0;
+    vm->mappings = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include <stdbool.h>
+
+#include "object.h"
+#include "vm.h"
+
+bool
+compile_bytecode(vm_t *context, const char *source, const char *path);
+bool
+is_bytecode(const char *path);
+obj_function *
+load_bytecode(const char *path);
+bool
+write_image(vm_t *context, const char *path);
+bool
+load_image(vm_t *context, const char *path);
+void
+mark_bytecode_roots(void);
+void
+forward_bytecode_roots(void);
+void
+free_bytecode(void);
+
+#endif /* clox_bytecode_h */
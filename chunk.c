@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
@@ -13,16 +14,30 @@ init_chunk(chunk_t *chunk)
     chunk->count = 0;
     chunk->capacity = 8;
     chunk->code = malloc(8 * sizeof(uint8_t));
-    chunk->lines = malloc(8 * sizeof(int));
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
+    chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
+    chunk->method_cache_count = 0;
+    chunk->method_cache_capacity = 0;
+    chunk->method_caches = NULL;
 }
 
 void
 free_chunk(chunk_t *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    /* code and lines loaded from a .loxc file belong to its mapping */
+    if (chunk->capacity > 0)
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    if (chunk->line_capacity > 0)
+        FREE_ARRAY(line_run_t, chunk->lines, chunk->line_capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(inline_cache_t, chunk->caches, chunk->cache_capacity);
+    FREE_ARRAY(
+      method_cache_t, chunk->method_caches, chunk->method_cache_capacity);
     init_chunk(chunk);
 }
 
@@ -34,14 +49,58 @@ write_chunk(chunk_t *chunk, uint8_t byte, int line)
         chunk->capacity = old_capacity * 2;
         chunk->code =
           GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines =
-          GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
     }
+    add_line(chunk, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+/* drops the code from count on along with its lines */
+void
+truncate_chunk(chunk_t *chunk, int count)
+{
+    chunk->count = count;
+    while (chunk->line_count > 0 &&
+           chunk->lines[chunk->line_count - 1].offset >= count)
+        chunk->line_count--;
+}
+
+/* records that the code from offset on came from line, offsets have to
+ * come in order. only a change of line starts a new run */
+void
+add_line(chunk_t *chunk, int offset, int line)
+{
+    if (chunk->line_count > 0 &&
+        chunk->lines[chunk->line_count - 1].line == line)
+        return;
+    if (chunk->line_capacity < chunk->line_count + 1) {
+        int old_capacity = chunk->line_capacity;
+        chunk->line_capacity = grow_capacity(old_capacity);
+        chunk->lines = GROW_ARRAY(
+          line_run_t, chunk->lines, old_capacity, chunk->line_capacity);
+    }
+    line_run_t *run = &chunk->lines[chunk->line_count++];
+    run->offset = offset;
+    run->line = line;
+}
+
+/* the line of the byte at offset, from the last run starting at or
+ * before it */
+int
+get_line(chunk_t *chunk, int offset)
+{
+    int low = 0;
+    int high = chunk->line_count - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return chunk->lines[low].line;
+}
+
 int
 add_constant(chunk_t *chunk, value_t value)
 {
@@ -50,3 +109,124 @@ add_constant(chunk_t *chunk, value_t value)
     pop();
     return chunk->constants.count - 1;
 }
+
+int
+add_cache(chunk_t *chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        int old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = grow_capacity(old_capacity);
+        chunk->caches = GROW_ARRAY(
+          inline_cache_t, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    chunk->caches[chunk->cache_count].count = 0;
+    return chunk->cache_count++;
+}
+
+int
+add_method_cache(chunk_t *chunk)
+{
+    if (chunk->method_cache_capacity < chunk->method_cache_count + 1) {
+        int old_capacity = chunk->method_cache_capacity;
+        chunk->method_cache_capacity = grow_capacity(old_capacity);
+        chunk->method_caches = GROW_ARRAY(method_cache_t,
+                                          chunk->method_caches,
+                                          old_capacity,
+                                          chunk->method_cache_capacity);
+    }
+    method_cache_t *cache = &chunk->method_caches[chunk->method_cache_count];
+    cache->class = NULL;
+    cache->version = 0;
+    cache->method = nil_val();
+    return chunk->method_cache_count++;
+}
+
+/* the generic op a quickened one was rewritten from, other ops map to
+ * themselves */
+uint8_t
+unquickened_op(uint8_t instruction)
+{
+    switch (instruction) {
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+            return OP_ADD;
+        case OP_SUBTRACT_NUMBER:
+            return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBER:
+            return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBER:
+            return OP_DIVIDE;
+        case OP_GREATER_NUMBER:
+            return OP_GREATER;
+        case OP_LESS_NUMBER:
+            return OP_LESS;
+        case OP_GET_FIELD:
+            return OP_GET_PROPERTY;
+        case OP_SET_FIELD:
+            return OP_SET_PROPERTY;
+        default:
+            return instruction;
+    }
+}
+
+/* the size in bytes of the instruction at offset, operands included */
+int
+instruction_length(chunk_t *chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_ADD_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 5;
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 6;
+        case OP_CLOSURE: {
+            value_t constant = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * as_function(constant)->upvalue_count;
+        }
+        case OP_CLOSURE_LONG: {
+            int index = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+            value_t constant = chunk->constants.values[index];
+            return 3 + 3 * as_function(constant)->upvalue_count;
+        }
+        default:
+            return 1;
+    }
+}
@@ -5,6 +5,9 @@
 
 #include "value.h"
 
+typedef struct obj_class obj_class;
+typedef struct obj_shape obj_shape;
+
 typedef enum
 {
     OP_CONSTANT,
@@ -34,6 +37,7 @@ typedef enum
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE, /* only emitted by the peephole pass */
     OP_LOOP,
     OP_CALL,
     OP_INVOKE,
@@ -44,15 +48,98 @@ typedef enum
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    /* the same instructions with a 16-bit constant, slot or upvalue operand,
+     * only emitted when it doesn't fit in a byte. the property forms have no
+     * inline cache */
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_UPVALUE_LONG,
+    OP_SET_UPVALUE_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_SUPER_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    OP_CLOSURE_LONG, /* upvalue indices are 16-bit too */
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    /* superinstructions fused by the compiler from common sequences */
+    OP_ADD_LOCAL_LOCAL,          /* GET_LOCAL, GET_LOCAL, ADD */
+    OP_ADD_LOCAL_CONSTANT,       /* GET_LOCAL, CONSTANT, ADD */
+    OP_SUBTRACT_LOCAL_CONSTANT,  /* GET_LOCAL, CONSTANT, SUBTRACT */
+    OP_LESS_LOCAL_CONSTANT_JUMP, /* GET_LOCAL, CONSTANT, LESS, JUMP_IF_FALSE */
+    /* quickened forms, never emitted by the compiler, run() rewrites a generic
+     * op into one of these in place once it has seen the operand types and
+     * back again when the guard fails */
+    OP_ADD_NUMBER,
+    OP_ADD_STRING,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_GET_FIELD, /* GET_PROPERTY with a single field cache entry */
+    OP_SET_FIELD, /* SET_PROPERTY with a single field cache entry */
+    OPCODE_COUNT, /* not an instruction */
 } op_code;
 
+#define PROPERTY_CACHE_WAYS 4
+
+/* what a property site saw for one shape: the slot of the field, or the
+ * method found when the shape has no such field. a set that added the
+ * field also records the shape the instance moved to */
+typedef struct
+{
+    obj_shape *shape;
+    obj_shape *next_shape;
+    uint32_t version;
+    int slot;
+    value_t method;
+} cache_entry_t;
+
+/* one per OP_GET_PROPERTY/OP_SET_PROPERTY site, monomorphic while count is
+ * 1, polymorphic up to PROPERTY_CACHE_WAYS shapes and megamorphic once a
+ * site has seen more than that */
+typedef struct
+{
+    int count;
+    cache_entry_t entries[PROPERTY_CACHE_WAYS];
+} inline_cache_t;
+
+/* one per OP_INVOKE/OP_SUPER_INVOKE site, the method last called there and
+ * the receiver class (and its version) it was looked up in */
+typedef struct
+{
+    obj_class *class;
+    uint32_t version;
+    value_t method;
+} method_cache_t;
+
+/* the line of the code from offset up to the next run's offset */
+typedef struct
+{
+    int offset;
+    int line;
+} line_run_t;
+
+/* capacity and line_capacity are 0 when code and lines point into a
+ * mapped .loxc file */
 typedef struct
 {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int line_count;
+    int line_capacity;
+    line_run_t *lines;
     value_array constants;
+    int cache_count;
+    int cache_capacity;
+    inline_cache_t *caches;
+    int method_cache_count;
+    int method_cache_capacity;
+    method_cache_t *method_caches;
 } chunk_t;
 
 void
@@ -61,7 +148,21 @@ void
 free_chunk(chunk_t *);
 void
 write_chunk(chunk_t *, uint8_t byte, int line);
+void
+truncate_chunk(chunk_t *, int count);
+void
+add_line(chunk_t *, int offset, int line);
+int
+get_line(chunk_t *, int offset);
 int
 add_constant(chunk_t *, value_t);
+int
+add_cache(chunk_t *);
+uint8_t
+unquickened_op(uint8_t instruction);
+int
+instruction_length(chunk_t *, int offset);
+int
+add_method_cache(chunk_t *);
 
 #endif /* clox_chunk_h */
@@ -2,5 +2,6 @@
 #define clox_common_h
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif /* clox_common_h */
@@ -13,8 +13,10 @@
 #endif
 #include "memory.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 
 typedef struct
 {
@@ -57,7 +59,7 @@ typedef struct
 
 typedef struct
 {
-    uint8_t index;
+    uint16_t index;
     bool is_local;
 } upvalue_t;
 
@@ -74,10 +76,23 @@ typedef struct compiler_t
     struct compiler_t *enclosing;
     obj_function *function;
     function_type type;
-    local_t locals[UINT8_COUNT];
+    local_t *locals;
     int local_count;
-    upvalue_t upvalues[UINT8_COUNT];
+    int local_capacity;
+    upvalue_t *upvalues;
+    int upvalue_capacity;
+    /* open addressing map from a constant to its index in the chunk, so
+     * each name or number is only added once. -1 marks an empty slot */
+    int *constant_slots;
+    int constant_slot_capacity;
+    /* the offset of the OP_CONSTANT that added each constant, -1 for the
+     * rest, so folding can take back operands nothing else uses */
+    int *constant_origins;
+    int constant_origin_capacity;
     int scope_depth;
+    /* start offsets of the last opcodes emitted, -1 once a jump target
+     * separates them from what comes next */
+    int recent_ops[3];
 } compiler_t;
 
 typedef struct class_compiler_t
@@ -86,9 +101,11 @@ typedef struct class_compiler_t
     bool has_superclass;
 } class_compiler_t;
 
-static parser_t parser;
-static compiler_t *current = NULL;
-class_compiler_t *current_class = NULL;
+/* per thread, a compile runs start to finish on the thread of the VM it
+ * compiles for */
+static _Thread_local parser_t parser;
+static _Thread_local compiler_t *current = NULL;
+static _Thread_local class_compiler_t *current_class = NULL;
 
 static chunk_t *
 current_chunk(void)
@@ -102,16 +119,16 @@ error_at(token_t *token, const char *message)
     if (parser.panic_mode)
         return;
     parser.panic_mode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
-        fprintf(stderr, " at end");
+        fprintf(vm->err, " at end");
     else if (token->type == TOKEN_ERROR)
         ;
     else
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(vm->err, " at '%.*s'", token->length, token->start);
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(vm->err, ": %s\n", message);
     parser.had_error = true;
 }
 
@@ -166,8 +183,327 @@ match(token_type type)
     return true;
 }
 
+static void
+forget_recent_ops(void)
+{
+    for (int i = 0; i < 3; i++)
+        current->recent_ops[i] = -1;
+}
+
+static void
+remember_op(int offset)
+{
+    current->recent_ops[0] = current->recent_ops[1];
+    current->recent_ops[1] = current->recent_ops[2];
+    current->recent_ops[2] = offset;
+}
+
+static bool
+recent_ops_are(op_code first, op_code second)
+{
+    chunk_t *chunk = current_chunk();
+    int a = current->recent_ops[1];
+    int b = current->recent_ops[2];
+    return a != -1 && b != -1 && chunk->code[a] == first &&
+           chunk->code[b] == second;
+}
+
+/* replaces everything from start on with a three byte superinstruction,
+ * the last byte gets the line of the op that can raise a runtime error
+ * since that is the byte runtime_error looks up */
+static void
+rewrite_tail(int start, op_code op, int error_line)
+{
+    chunk_t *chunk = current_chunk();
+    uint8_t operand1 = chunk->code[start + 1];
+    uint8_t operand2 = chunk->code[start + 3];
+    chunk->code[start] = op;
+    chunk->code[start + 1] = operand1;
+    truncate_chunk(chunk, start + 2);
+    write_chunk(chunk, operand2, error_line);
+    forget_recent_ops();
+    remember_op(start);
+}
+
+static bool
+fuse_superinstruction(op_code op)
+{
+    int line = parser.previous.line;
+
+    switch (op) {
+        case OP_ADD:
+            if (recent_ops_are(OP_GET_LOCAL, OP_GET_LOCAL)) {
+                rewrite_tail(current->recent_ops[1], OP_ADD_LOCAL_LOCAL, line);
+                return true;
+            }
+            if (recent_ops_are(OP_GET_LOCAL, OP_CONSTANT)) {
+                rewrite_tail(
+                  current->recent_ops[1], OP_ADD_LOCAL_CONSTANT, line);
+                return true;
+            }
+            return false;
+        case OP_SUBTRACT:
+            if (recent_ops_are(OP_GET_LOCAL, OP_CONSTANT)) {
+                rewrite_tail(
+                  current->recent_ops[1], OP_SUBTRACT_LOCAL_CONSTANT, line);
+                return true;
+            }
+            return false;
+        case OP_JUMP_IF_FALSE: {
+            /* GET_LOCAL, CONSTANT, LESS: the jump operand is appended by
+             * emit_jump so it stays the last two bytes for patch_jump */
+            int start = current->recent_ops[0];
+            int less = current->recent_ops[2];
+            if (start == -1 || !recent_ops_are(OP_CONSTANT, OP_LESS) ||
+                current_chunk()->code[start] != OP_GET_LOCAL)
+                return false;
+            rewrite_tail(start,
+                         OP_LESS_LOCAL_CONSTANT_JUMP,
+                         get_line(current_chunk(), less));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void
+emit_byte(op_code byte);
+static void
+emit_constant(value_t value);
+static void
+drop_constant(int offset);
+
+/* the value the instruction at offset pushes, if it is a literal */
+static bool
+literal_at(int offset, value_t *value)
+{
+    if (offset == -1)
+        return false;
+    chunk_t *chunk = current_chunk();
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+            *value = nil_val();
+            return true;
+        case OP_TRUE:
+            *value = bool_val(true);
+            return true;
+        case OP_FALSE:
+            *value = bool_val(false);
+            return true;
+        case OP_CONSTANT:
+            *value = chunk->constants.values[chunk->code[offset + 1]];
+            return true;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants
+                       .values[chunk->code[offset + 1] << 8 |
+                               chunk->code[offset + 2]];
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+literal_falsey(value_t value)
+{
+    return is_nil(value) || (is_bool(value) && !as_bool(value));
+}
+
+/* the instruction at offset always leaves a number (or raises an error) */
+static bool
+yields_number(int offset)
+{
+    if (offset == -1)
+        return false;
+    switch (current_chunk()->code[offset]) {
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+yields_bool(int offset)
+{
+    if (offset == -1)
+        return false;
+    switch (current_chunk()->code[offset]) {
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* removes the last one or two instructions, the ones before them stay
+ * available for folding and fusion */
+static void
+drop_recent_ops(int count)
+{
+    for (int i = 2; i >= 3 - count; i--)
+        drop_constant(current->recent_ops[i]);
+    truncate_chunk(current_chunk(), current->recent_ops[3 - count]);
+    for (int i = 2; i >= 0; i--)
+        current->recent_ops[i] = i >= count ? current->recent_ops[i - count]
+                                            : -1;
+}
+
+static void
+emit_literal(value_t value)
+{
+    if (is_nil(value))
+        emit_byte(OP_NIL);
+    else if (is_bool(value))
+        emit_byte(as_bool(value) ? OP_TRUE : OP_FALSE);
+    else
+        emit_constant(value);
+}
+
+static obj_string *
+concatenate_literals(obj_string *a, obj_string *b)
+{
+    int length = a->length + b->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    chars[length] = '\0';
+    return take_string(chars, length);
+}
+
+/* evaluates op at compile time when its operands are literals, or drops it
+ * when it can't change its operand. anything that would be a runtime error
+ * is left for the runtime to report */
+static bool
+fold_constants(op_code op)
+{
+    int left = current->recent_ops[1];
+    int right = current->recent_ops[2];
+    value_t a, b;
+
+    switch (op) {
+        case OP_NOT:
+            if (literal_at(right, &b)) {
+                drop_recent_ops(1);
+                emit_literal(bool_val(literal_falsey(b)));
+                return true;
+            }
+            /* !!x is x when x is already a boolean */
+            if (yields_bool(right) && current_chunk()->code[right] == OP_NOT &&
+                yields_bool(left)) {
+                drop_recent_ops(1);
+                return true;
+            }
+            return false;
+        case OP_NEGATE:
+            if (!literal_at(right, &b) || !is_number(b))
+                return false;
+            drop_recent_ops(1);
+            emit_literal(number_val(-as_number(b)));
+            return true;
+        default:
+            break;
+    }
+
+    if (!literal_at(right, &b))
+        return false;
+    if (!literal_at(left, &a)) {
+        /* x - 0, x * 1 and x / 1 are x when x is known to be a number,
+         * the other identities break for strings or -0 */
+        if (!is_number(b) || !yields_number(left))
+            return false;
+        double number = as_number(b);
+        double zero = 0;
+        bool is_zero = memcmp(&number, &zero, sizeof(double)) == 0;
+        if ((op == OP_SUBTRACT && is_zero) ||
+            ((op == OP_MULTIPLY || op == OP_DIVIDE) && number == 1)) {
+            drop_recent_ops(1);
+            return true;
+        }
+        return false;
+    }
+
+    value_t result;
+    if (op == OP_EQUAL) {
+        result = bool_val(values_equal(a, b));
+    } else if (op == OP_ADD && is_string(a) && is_string(b)) {
+        result = obj_val(
+          (obj_t *)concatenate_literals(as_string(a), as_string(b)));
+    } else if (is_number(a) && is_number(b)) {
+        double x = as_number(a);
+        double y = as_number(b);
+        switch (op) {
+            case OP_GREATER:
+                result = bool_val(x > y);
+                break;
+            case OP_LESS:
+                result = bool_val(x < y);
+                break;
+            case OP_ADD:
+                result = number_val(x + y);
+                break;
+            case OP_SUBTRACT:
+                result = number_val(x - y);
+                break;
+            case OP_MULTIPLY:
+                result = number_val(x * y);
+                break;
+            case OP_DIVIDE:
+                result = number_val(x / y);
+                break;
+            default:
+                return false;
+        }
+    } else {
+        return false;
+    }
+
+    drop_recent_ops(2);
+    emit_literal(result);
+    return true;
+}
+
+/* if the last instruction pushes a literal, removes it and returns the
+ * value */
+static bool
+pop_literal(value_t *value)
+{
+    if (!literal_at(current->recent_ops[2], value))
+        return false;
+    drop_recent_ops(1);
+    return true;
+}
+
+/* throws away code compiled from start on, for branches that can never
+ * run. it is still compiled so it gets checked for errors */
+static void
+discard_code(int start)
+{
+    truncate_chunk(current_chunk(), start);
+    forget_recent_ops();
+}
+
 static void
 emit_byte(op_code byte)
+{
+    if (fold_constants(byte))
+        return;
+    if (fuse_superinstruction(byte))
+        return;
+    remember_op(current_chunk()->count);
+    write_chunk(current_chunk(), byte, parser.previous.line);
+}
+
+static void
+emit_operand(uint8_t byte)
 {
     write_chunk(current_chunk(), byte, parser.previous.line);
 }
@@ -176,7 +512,36 @@ static void
 emit_bytes(op_code byte1, uint8_t byte2)
 {
     emit_byte(byte1);
-    emit_byte(byte2);
+    emit_operand(byte2);
+}
+
+static void
+emit_short(uint16_t operand)
+{
+    emit_operand((operand >> 8) & 0xff);
+    emit_operand(operand & 0xff);
+}
+
+/* op with a one byte operand, or long_op with a two byte one when the
+ * operand doesn't fit */
+static void
+emit_indexed(op_code op, op_code long_op, int operand)
+{
+    if (operand <= UINT8_MAX) {
+        emit_bytes(op, (uint8_t)operand);
+    } else {
+        emit_byte(long_op);
+        emit_short((uint16_t)operand);
+    }
+}
+
+/* code emitted after this point can be jumped to, so it must not be fused
+ * with the instructions before it */
+static int
+jump_target(void)
+{
+    forget_recent_ops();
+    return current_chunk()->count;
 }
 
 static void
@@ -188,16 +553,35 @@ emit_loop(int loop_start)
     if (offset > UINT16_MAX)
         error("Loop body too large.");
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_short((uint16_t)offset);
+}
+
+static void
+emit_cache(void)
+{
+    int cache = add_cache(current_chunk());
+    if (cache > UINT16_MAX)
+        error("Too many property accesses in one chunk.");
+
+    emit_short((uint16_t)cache);
+}
+
+static void
+emit_method_cache(void)
+{
+    int cache = add_method_cache(current_chunk());
+    if (cache > UINT16_MAX)
+        error("Too many method calls in one chunk.");
+
+    emit_short((uint16_t)cache);
 }
 
 static int
 emit_jump(uint8_t instruction)
 {
     emit_byte(instruction);
-    emit_byte(0xff);
-    emit_byte(0xff);
+    emit_operand(0xff);
+    emit_operand(0xff);
     return current_chunk()->count - 2;
 }
 
@@ -211,27 +595,151 @@ emit_return(void)
     emit_byte(OP_RETURN);
 }
 
-static uint8_t
+/* strings are interned so identity is enough, numbers compare by bit
+ * pattern so 0 and -0 stay distinct */
+static bool
+constants_identical(value_t a, value_t b)
+{
+    if (is_number(a) && is_number(b)) {
+        double x = as_number(a);
+        double y = as_number(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return is_obj(a) && is_obj(b) && as_obj(a) == as_obj(b);
+}
+
+static uint32_t
+constant_hash(value_t value)
+{
+    if (is_string(value))
+        return as_string(value)->hash;
+
+    uint64_t bits;
+    if (is_number(value)) {
+        double number = as_number(value);
+        memcpy(&bits, &number, sizeof(double));
+    } else {
+        bits = (uint64_t)(uintptr_t)as_obj(value);
+    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdu;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static int *
+constant_slot(value_t value)
+{
+    value_t *constants = current_chunk()->constants.values;
+    uint32_t mask = (uint32_t)current->constant_slot_capacity - 1;
+    uint32_t index = constant_hash(value) & mask;
+    for (;;) {
+        int *slot = &current->constant_slots[index];
+        if (*slot == -1 || constants_identical(constants[*slot], value))
+            return slot;
+        index = (index + 1) & mask;
+    }
+}
+
+static void
+constant_slots_grow(void)
+{
+    FREE_ARRAY(
+      int, current->constant_slots, current->constant_slot_capacity);
+    current->constant_slot_capacity =
+      grow_capacity(current->constant_slot_capacity);
+    current->constant_slots =
+      ALLOCATE(int, current->constant_slot_capacity);
+    for (int i = 0; i < current->constant_slot_capacity; i++)
+        current->constant_slots[i] = -1;
+
+    value_array *constants = &current_chunk()->constants;
+    for (int i = 0; i < constants->count; i++)
+        *constant_slot(constants->values[i]) = i;
+}
+
+static int
 make_constant(value_t value)
 {
+    /* growing the map can collect, keep a freshly copied name alive */
+    int count = current_chunk()->constants.count;
+    if ((count + 1) * 4 > current->constant_slot_capacity * 3) {
+        push(value);
+        constant_slots_grow();
+        pop();
+    }
+
+    int *slot = constant_slot(value);
+    if (*slot != -1)
+        return *slot;
+
     int constant = add_constant(current_chunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
-    return (uint8_t)constant;
+    *slot = constant;
+
+    if (current->constant_origin_capacity < constant + 1) {
+        int old_capacity = current->constant_origin_capacity;
+        current->constant_origin_capacity = grow_capacity(old_capacity);
+        current->constant_origins =
+          GROW_ARRAY(int,
+                     current->constant_origins,
+                     old_capacity,
+                     current->constant_origin_capacity);
+    }
+    current->constant_origins[constant] = -1;
+    return constant;
 }
 
 static void
 emit_constant(value_t value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    int offset = current_chunk()->count;
+    int count = current_chunk()->constants.count;
+    int constant = make_constant(value);
+    if (current_chunk()->constants.count > count)
+        current->constant_origins[constant] = offset;
+    emit_indexed(OP_CONSTANT, OP_CONSTANT_LONG, constant);
+}
+
+/* takes the constant an instruction that's being dropped pushes back out
+ * of the chunk, if that instruction added it and it's still the last */
+static void
+drop_constant(int offset)
+{
+    chunk_t *chunk = current_chunk();
+    int constant;
+    if (chunk->code[offset] == OP_CONSTANT)
+        constant = chunk->code[offset + 1];
+    else if (chunk->code[offset] == OP_CONSTANT_LONG)
+        constant = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+    else
+        return;
+    if (constant != chunk->constants.count - 1 ||
+        current->constant_origins[constant] != offset)
+        return;
+
+    /* the ones probed past its slot are put back where a lookup that no
+     * longer stops there finds them */
+    uint32_t mask = (uint32_t)current->constant_slot_capacity - 1;
+    int *slot = constant_slot(chunk->constants.values[constant]);
+    *slot = -1;
+    uint32_t index = (uint32_t)(slot - current->constant_slots);
+    for (index = (index + 1) & mask; current->constant_slots[index] != -1;
+         index = (index + 1) & mask) {
+        int moved = current->constant_slots[index];
+        current->constant_slots[index] = -1;
+        *constant_slot(chunk->constants.values[moved]) = moved;
+    }
+    chunk->constants.count--;
 }
 
 static void
 patch_jump(int offset)
 {
-    int jump = current_chunk()->count - offset - 2;
+    int jump = jump_target() - offset - 2;
 
     if (jump > UINT16_MAX)
         error("Too much code to jump over.");
@@ -240,22 +748,45 @@ patch_jump(int offset)
     current_chunk()->code[offset + 1] = jump & 0xff;
 }
 
+static local_t *
+push_local(void)
+{
+    if (current->local_capacity < current->local_count + 1) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = grow_capacity(old_capacity);
+        current->locals = GROW_ARRAY(
+          local_t, current->locals, old_capacity, current->local_capacity);
+    }
+    if (current->local_count + 1 > current->function->max_slots)
+        current->function->max_slots = current->local_count + 1;
+    return &current->locals[current->local_count++];
+}
+
 static void
 compiler_init(compiler_t *compiler, function_type type)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalue_capacity = 0;
+    compiler->constant_slots = NULL;
+    compiler->constant_slot_capacity = 0;
+    compiler->constant_origins = NULL;
+    compiler->constant_origin_capacity = 0;
     compiler->scope_depth = 0;
     compiler->function = newfunction();
     current = compiler;
+    forget_recent_ops();
     if (type != TYPE_SCRIPT)
         current->function->name =
           copy_string(parser.previous.start, parser.previous.length);
 
     /* what does this do again? */
-    local_t *local = &current->locals[current->local_count++];
+    local_t *local = push_local();
     local->depth = 0;
     local->is_captured = false;
     if (type != TYPE_FUNCTION) {
@@ -267,11 +798,35 @@ compiler_init(compiler_t *compiler, function_type type)
     }
 }
 
+/* the upvalues are still needed after compiler_end to emit OP_CLOSURE */
+static void
+compiler_free(compiler_t *compiler)
+{
+    FREE_ARRAY(local_t, compiler->locals, compiler->local_capacity);
+    FREE_ARRAY(upvalue_t, compiler->upvalues, compiler->upvalue_capacity);
+    FREE_ARRAY(int, compiler->constant_slots, compiler->constant_slot_capacity);
+    FREE_ARRAY(
+      int, compiler->constant_origins, compiler->constant_origin_capacity);
+}
+
 static obj_function *
 compiler_end(void)
 {
     emit_return();
     obj_function *function = current->function;
+#ifndef NO_PEEPHOLE
+    if (!parser.had_error) {
+        int saved = optimize_chunk(current_chunk());
+#ifdef DEBUG_LOG_PEEPHOLE
+        printf("-- peephole %s: %d -> %d bytes\n",
+               function->name != NULL ? function->name->chars : "<script>",
+               current_chunk()->count + saved,
+               current_chunk()->count);
+#else
+        (void)saved;
+#endif
+    }
+#endif
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error)
         disassemble_chunk(current_chunk(),
@@ -314,13 +869,32 @@ get_rule(token_type type);
 static void
 parse_precedence(precedence_t precedence);
 
-static uint8_t
+static int
 identifier_constant(token_t *name)
 {
     return make_constant(
       obj_val((obj_t *)copy_string(name->start, name->length)));
 }
 
+static int
+identifier_global(token_t *name)
+{
+    int index = global_index(copy_string(name->start, name->length));
+    if (index > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return index;
+}
+
+static void
+emit_global(uint8_t instruction, int index)
+{
+    emit_byte(instruction);
+    emit_operand((index >> 8) & 0xff);
+    emit_operand(index & 0xff);
+}
+
 static bool
 identifiers_equal(token_t *a, token_t *b)
 {
@@ -332,11 +906,11 @@ identifiers_equal(token_t *a, token_t *b)
 static void
 add_local(token_t name)
 {
-    if (current->local_count == UINT8_COUNT) {
+    if (current->local_count == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
-    local_t *local = &current->locals[current->local_count++];
+    local_t *local = push_local();
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
@@ -349,7 +923,7 @@ variable_declare(void)
         return;
     token_t *name = &parser.previous;
 
-    for (int i = current->local_count - 1; i >= 0; i++) {
+    for (int i = current->local_count - 1; i >= 0; i--) {
         local_t *local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scope_depth)
             break;
@@ -360,14 +934,14 @@ variable_declare(void)
     add_local(*name);
 }
 
-static uint8_t
+static int
 parse_variable(const char *error_message)
 {
     consume(TOKEN_IDENTIFIER, error_message);
     variable_declare();
     if (current->scope_depth > 0)
         return 0;
-    return identifier_constant(&parser.previous);
+    return identifier_global(&parser.previous);
 }
 
 static void
@@ -379,13 +953,13 @@ mark_initialized(void)
 }
 
 static void
-variable_define(uint8_t global)
+variable_define(int global)
 {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t
@@ -428,7 +1002,7 @@ resolve_local(compiler_t *compiler, token_t *name)
 }
 
 static int
-add_upvalue(compiler_t *compiler, uint8_t index, bool is_local)
+add_upvalue(compiler_t *compiler, uint16_t index, bool is_local)
 {
     int upvalue_count = compiler->function->upvalue_count;
 
@@ -437,10 +1011,18 @@ add_upvalue(compiler_t *compiler, uint8_t index, bool is_local)
         if (upvalue->index == index && upvalue->is_local == is_local)
             return i;
     }
-    if (upvalue_count == UINT8_COUNT) {
+    if (upvalue_count == UINT16_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
+    if (compiler->upvalue_capacity < upvalue_count + 1) {
+        int old_capacity = compiler->upvalue_capacity;
+        compiler->upvalue_capacity = grow_capacity(old_capacity);
+        compiler->upvalues = GROW_ARRAY(upvalue_t,
+                                        compiler->upvalues,
+                                        old_capacity,
+                                        compiler->upvalue_capacity);
+    }
     compiler->upvalues[upvalue_count].is_local = is_local;
     compiler->upvalues[upvalue_count].index = index;
     return compiler->function->upvalue_count++;
@@ -454,11 +1036,11 @@ resolve_upvalue(compiler_t *compiler, token_t *name)
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(compiler, (uint16_t)local, true);
     }
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1)
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(compiler, (uint16_t)upvalue, false);
     return -1;
 }
 
@@ -471,7 +1053,8 @@ binary(bool can_assign)
 
     switch (operator_type) {
         case TOKEN_BANG_EQUAL:
-            emit_bytes(OP_EQUAL, OP_NOT);
+            emit_byte(OP_EQUAL);
+            emit_byte(OP_NOT);
             break;
         case TOKEN_EQUAL_EQUAL:
             emit_byte(OP_EQUAL);
@@ -480,13 +1063,15 @@ binary(bool can_assign)
             emit_byte(OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emit_bytes(OP_LESS, OP_NOT);
+            emit_byte(OP_LESS);
+            emit_byte(OP_NOT);
             break;
         case TOKEN_LESS:
             emit_byte(OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emit_bytes(OP_GREATER, OP_NOT);
+            emit_byte(OP_GREATER);
+            emit_byte(OP_NOT);
             break;
         case TOKEN_PLUS:
             emit_byte(OP_ADD);
@@ -517,17 +1102,22 @@ static void
 dot(bool can_assign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&parser.previous);
+    int name = identifier_constant(&parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_indexed(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+        if (name <= UINT8_MAX)
+            emit_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
-        emit_byte(arg_count);
+        emit_indexed(OP_INVOKE, OP_INVOKE_LONG, name);
+        emit_operand(arg_count);
+        emit_method_cache();
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_indexed(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        if (name <= UINT8_MAX)
+            emit_cache();
     }
 }
 
@@ -587,25 +1177,34 @@ string(bool can_assign)
 static void
 named_variable(token_t name, bool can_assign)
 {
-    uint8_t get_op, set_op;
+    op_code get_op, set_op, get_long_op, set_long_op;
     int arg = resolve_local(current, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
+        get_long_op = OP_GET_LOCAL_LONG;
+        set_long_op = OP_SET_LOCAL_LONG;
     } else if ((arg = resolve_upvalue(current, &name)) != -1) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
+        get_long_op = OP_GET_UPVALUE_LONG;
+        set_long_op = OP_SET_UPVALUE_LONG;
     } else {
-        arg = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        arg = identifier_global(&name);
+        if (can_assign && match(TOKEN_EQUAL)) {
+            expression();
+            emit_global(OP_SET_GLOBAL, arg);
+        } else {
+            emit_global(OP_GET_GLOBAL, arg);
+        }
+        return;
     }
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_indexed(set_op, set_long_op, arg);
     } else {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_indexed(get_op, get_long_op, arg);
     }
 }
 
@@ -634,18 +1233,19 @@ super_(bool can_assign)
 
     consume(TOKEN_DOT, "Expect '.' after 'super',");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(&parser.previous);
+    int name = identifier_constant(&parser.previous);
 
     named_variable(synthetic_token("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
-        emit_byte(arg_count);
+        emit_indexed(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
+        emit_operand(arg_count);
+        emit_method_cache();
     } else {
 
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_indexed(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
@@ -779,8 +1379,8 @@ function(function_type type)
             current->function->arity++;
             if (current->function->arity > 255)
                 error_at_current("Can't have more than 255 parameters.");
-            uint8_t constant = parse_variable("Expect parameter name.");
-            variable_define(constant);
+            int local = parse_variable("Expect parameter name.");
+            variable_define(local);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -788,25 +1388,39 @@ function(function_type type)
     block();
 
     obj_function *function = compiler_end();
-    emit_bytes(OP_CLOSURE, make_constant(obj_val((obj_t *)function)));
+    int constant = make_constant(obj_val((obj_t *)function));
+
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalue_count; i++)
+        wide = wide || compiler.upvalues[i].index > UINT8_MAX;
 
+    if (wide) {
+        emit_byte(OP_CLOSURE_LONG);
+        emit_short((uint16_t)constant);
+    } else {
+        emit_bytes(OP_CLOSURE, (uint8_t)constant);
+    }
     for (int i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_operand(compiler.upvalues[i].is_local ? 1 : 0);
+        if (wide)
+            emit_short(compiler.upvalues[i].index);
+        else
+            emit_operand((uint8_t)compiler.upvalues[i].index);
     }
+    compiler_free(&compiler);
 }
 
 static void
 method(void)
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(&parser.previous);
+    int constant = identifier_constant(&parser.previous);
     function_type type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
         memcmp(parser.previous.start, "init", 4) == 0)
         type = TYPE_INITIALIZER;
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_indexed(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void
@@ -814,11 +1428,12 @@ class_declaration(void)
 {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     token_t classname = parser.previous;
-    uint8_t name_constant = identifier_constant(&parser.previous);
+    int name_constant = identifier_constant(&parser.previous);
     variable_declare();
+    int global = current->scope_depth > 0 ? 0 : identifier_global(&classname);
 
-    emit_bytes(OP_CLASS, name_constant);
-    variable_define(name_constant);
+    emit_indexed(OP_CLASS, OP_CLASS_LONG, name_constant);
+    variable_define(global);
 
     class_compiler_t class_compiler;
     class_compiler.has_superclass = false;
@@ -854,7 +1469,7 @@ class_declaration(void)
 static void
 fun_declaration(void)
 {
-    uint8_t global = parse_variable("Expect function name.");
+    int global = parse_variable("Expect function name.");
     mark_initialized();
     function(TYPE_FUNCTION);
     variable_define(global);
@@ -863,7 +1478,7 @@ fun_declaration(void)
 static void
 var_declaration(void)
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
     if (match(TOKEN_EQUAL))
         expression();
     else
@@ -890,18 +1505,25 @@ for_statement(void)
     else if (!match(TOKEN_SEMICOLON))
         expression_statement();
 
-    int loop_start = current_chunk()->count;
+    int loop_start = jump_target();
+    int dead_loop = -1;
     int exit_jump = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        value_t condition;
+        if (pop_literal(&condition)) {
+            if (literal_falsey(condition))
+                dead_loop = loop_start;
+        } else {
+            exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+            emit_byte(OP_POP);
+        }
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
-        int increment_start = current_chunk()->count;
+        int increment_start = jump_target();
         expression();
         emit_byte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -917,6 +1539,8 @@ for_statement(void)
         patch_jump(exit_jump);
         emit_byte(OP_POP);
     }
+    if (dead_loop != -1)
+        discard_code(dead_loop);
 
     scope_end();
 }
@@ -928,6 +1552,22 @@ if_statement(void)
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    value_t condition;
+    if (pop_literal(&condition)) {
+        bool taken = !literal_falsey(condition);
+        int start = current_chunk()->count;
+        statement();
+        if (!taken)
+            discard_code(start);
+        if (match(TOKEN_ELSE)) {
+            start = current_chunk()->count;
+            statement();
+            if (taken)
+                discard_code(start);
+        }
+        return;
+    }
+
     int then_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -968,11 +1608,21 @@ return_statement(void)
 static void
 while_statement(void)
 {
-    int loop_start = current_chunk()->count;
+    int loop_start = jump_target();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    value_t condition;
+    if (pop_literal(&condition)) {
+        statement();
+        if (literal_falsey(condition))
+            discard_code(loop_start);
+        else
+            emit_loop(loop_start);
+        return;
+    }
+
     int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     statement();
@@ -1057,6 +1707,7 @@ compile(const char *source)
     while (!match(TOKEN_EOF))
         declaration();
     obj_function *function = compiler_end();
+    compiler_free(&compiler);
     return parser.had_error ? NULL : function;
 }
 
@@ -1069,3 +1720,15 @@ mark_compiler_roots(void)
         compiler = compiler->enclosing;
     }
 }
+
+/* a compaction may have moved the functions being compiled */
+void
+forward_compiler_roots(void)
+{
+    compiler_t *compiler = current;
+    while (compiler != NULL) {
+        compiler->function =
+          (obj_function *)forward_object((obj_t *)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
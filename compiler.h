@@ -9,5 +9,7 @@ obj_function *
 compile(const char *source);
 void
 mark_compiler_roots(void);
+void
+forward_compiler_roots(void);
 
 #endif /* clox_compiler_h */
@@ -1,11 +1,85 @@
 #include "debug.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#ifdef DEBUG_OPCODE_STATS
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
 
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+static const char *opcode_names[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+    [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+    [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+    [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_ADD_LOCAL_LOCAL] = "OP_ADD_LOCAL_LOCAL",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT_JUMP] = "OP_LESS_LOCAL_CONSTANT_JUMP",
+    [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+    [OP_ADD_STRING] = "OP_ADD_STRING",
+    [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+    [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+    [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+    [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+    [OP_GET_FIELD] = "OP_GET_FIELD",
+    [OP_SET_FIELD] = "OP_SET_FIELD",
+};
 
 void
 disassemble_chunk(chunk_t *chunk, const char *name)
@@ -27,16 +101,54 @@ constant_instruction(const char *name, chunk_t *chunk, int offset)
 }
 
 static int
-invoke_instruction(const char *name, chunk_t *chunk, int offset)
+constant_long_instruction(const char *name, chunk_t *chunk, int offset)
 {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t arg_count = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, constant);
     print_value(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
+static int
+global_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint16_t index = (uint16_t)(chunk->code[offset + 1] << 8);
+    index |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, index);
+    print_value(vm->global_names.values[index]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int
+invoke_instruction(const char *name, chunk_t *chunk, int offset, bool wide)
+{
+    uint16_t constant = chunk->code[++offset];
+    if (wide)
+        constant = (uint16_t)(constant << 8 | chunk->code[++offset]);
+    uint8_t arg_count = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' [%d]\n", cache);
+    return offset + 4;
+}
+
+static int
+property_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' [%d]\n", cache);
+    return offset + 4;
+}
+
 static int
 simple_instruction(const char *name, int offset)
 {
@@ -52,6 +164,15 @@ byte_instruction(const char *name, chunk_t *chunk, int offset)
     return offset + 2;
 }
 
+static int
+short_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int
 jump_instruction(const char *name, int sign, chunk_t *chunk, int offset)
 {
@@ -61,6 +182,39 @@ jump_instruction(const char *name, int sign, chunk_t *chunk, int offset)
     return offset + 3;
 }
 
+static int
+local_local_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint8_t slot1 = chunk->code[offset + 1];
+    uint8_t slot2 = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, slot1, slot2);
+    return offset + 3;
+}
+
+static int
+local_constant_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int
+local_constant_jump_instruction(const char *name, chunk_t *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 int
 disassemble_instruction(chunk_t *chunk, int offset)
 {
@@ -69,11 +223,18 @@ disassemble_instruction(chunk_t *chunk, int offset)
         return simple_instruction(#OP, offset)
 
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = get_line(chunk, offset);
+    if (offset > 0 && line == get_line(chunk, offset - 1))
         printf("   | ");
     else
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
+    /* a quickened op is shown as its specialized name followed by the
+     * generic instruction it was rewritten from */
     uint8_t instruction = chunk->code[offset];
+    if (unquickened_op(instruction) != instruction) {
+        printf("%s <- ", opcode_names[instruction]);
+        instruction = unquickened_op(instruction);
+    }
     switch (instruction) {
         case OP_CONSTANT:
             return constant_instruction("OP_CONSTANT", chunk, offset);
@@ -85,19 +246,19 @@ disassemble_instruction(chunk_t *chunk, int offset)
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return global_instruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return global_instruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byte_instruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byte_instruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+            return property_instruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+            return property_instruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constant_instruction("OP_GET_SUPER", chunk, offset);
             SIMPLE_INSTRUCTION(OP_EQUAL);
@@ -115,28 +276,39 @@ disassemble_instruction(chunk_t *chunk, int offset)
             return jump_instruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", 1, chunk, offset);
+            return jump_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
-            return invoke_instruction("OP_INVOKE", chunk, offset);
+            return invoke_instruction("OP_INVOKE", chunk, offset, false);
         case OP_SUPER_INVOKE:
-            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+            return invoke_instruction(
+              "OP_SUPER_INVOKE", chunk, offset, false);
+        case OP_CLOSURE_LONG:
         case OP_CLOSURE: {
+            bool wide = instruction == OP_CLOSURE_LONG;
             offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            uint16_t constant = chunk->code[offset++];
+            if (wide)
+                constant = (uint16_t)(constant << 8 | chunk->code[offset++]);
+            printf("%-16s %4d ", wide ? "OP_CLOSURE_LONG" : "OP_CLOSURE",
+                   constant);
             print_value(chunk->constants.values[constant]);
             printf("\n");
 
             obj_function *function =
               as_function(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalue_count; j++) {
+                int pair = offset;
                 int is_local = chunk->code[offset++];
                 int index = chunk->code[offset++];
+                if (wide)
+                    index = index << 8 | chunk->code[offset++];
                 printf("%04d      |                     %s %d\n",
-                       offset - 2,
+                       pair,
                        is_local ? "local" : "upvalue",
                        index);
             }
@@ -150,9 +322,278 @@ disassemble_instruction(chunk_t *chunk, int offset)
             SIMPLE_INSTRUCTION(OP_INHERIT);
         case OP_METHOD:
             return constant_instruction("OP_METHOD", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constant_long_instruction(
+              "OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return short_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return short_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_UPVALUE_LONG:
+            return short_instruction("OP_GET_UPVALUE_LONG", chunk, offset);
+        case OP_SET_UPVALUE_LONG:
+            return short_instruction("OP_SET_UPVALUE_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return constant_long_instruction(
+              "OP_GET_PROPERTY_LONG", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return constant_long_instruction(
+              "OP_SET_PROPERTY_LONG", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constant_long_instruction(
+              "OP_GET_SUPER_LONG", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invoke_instruction("OP_INVOKE_LONG", chunk, offset, true);
+        case OP_SUPER_INVOKE_LONG:
+            return invoke_instruction(
+              "OP_SUPER_INVOKE_LONG", chunk, offset, true);
+        case OP_CLASS_LONG:
+            return constant_long_instruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return constant_long_instruction("OP_METHOD_LONG", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return local_local_instruction(
+              "OP_ADD_LOCAL_LOCAL", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return local_constant_instruction(
+              "OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return local_constant_instruction(
+              "OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return local_constant_jump_instruction(
+              "OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 #undef SIMPLE_INSTRUCTION
 }
+
+#ifdef DEBUG_OPCODE_STATS
+
+#define STATS_TEXT_ROWS 50
+
+/* each VM counts on its own. sequences are counted across call and
+ * return boundaries, in the order its ops were executed */
+typedef struct opcode_stats
+{
+    uint64_t singles[OPCODE_COUNT];
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+    uint64_t triples[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+    int previous1;
+    int previous2;
+    /* the next VM that's still counting */
+    struct opcode_stats *next;
+} opcode_stats_t;
+
+/* the VMs still counting, and what the freed ones counted added up */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static opcode_stats_t *live_stats = NULL;
+static opcode_stats_t *freed_stats = NULL;
+
+static opcode_stats_t *
+allocate_stats(void)
+{
+    opcode_stats_t *stats = calloc(1, sizeof(opcode_stats_t));
+    if (stats == NULL)
+        exit(EXIT_FAILURE);
+    stats->previous1 = -1;
+    stats->previous2 = -1;
+    return stats;
+}
+
+static void
+add_stats(opcode_stats_t *to, opcode_stats_t *from)
+{
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        to->singles[i] += from->singles[i];
+        for (int j = 0; j < OPCODE_COUNT; j++) {
+            to->pairs[i][j] += from->pairs[i][j];
+            for (int k = 0; k < OPCODE_COUNT; k++)
+                to->triples[i][j][k] += from->triples[i][j][k];
+        }
+    }
+}
+
+/* the histograms are written at exit, whichever VMs are left */
+struct opcode_stats *
+new_opcode_stats(void)
+{
+    opcode_stats_t *stats = allocate_stats();
+    pthread_mutex_lock(&stats_lock);
+    if (freed_stats == NULL) {
+        freed_stats = allocate_stats();
+        atexit(write_opcode_stats);
+    }
+    stats->next = live_stats;
+    live_stats = stats;
+    pthread_mutex_unlock(&stats_lock);
+    return stats;
+}
+
+void
+free_opcode_stats(struct opcode_stats *stats)
+{
+    pthread_mutex_lock(&stats_lock);
+    opcode_stats_t **link = &live_stats;
+    while (*link != stats)
+        link = &(*link)->next;
+    *link = stats->next;
+    add_stats(freed_stats, stats);
+    pthread_mutex_unlock(&stats_lock);
+    free(stats);
+}
+
+void
+count_opcode(struct opcode_stats *stats, uint8_t op)
+{
+    stats->singles[op]++;
+    if (stats->previous1 != -1)
+        stats->pairs[stats->previous1][op]++;
+    if (stats->previous2 != -1)
+        stats->triples[stats->previous2][stats->previous1][op]++;
+    stats->previous2 = stats->previous1;
+    stats->previous1 = op;
+}
+
+typedef struct
+{
+    uint64_t count;
+    int length;
+    uint8_t ops[3];
+} ngram_t;
+
+static int
+ngram_compare(const void *a, const void *b)
+{
+    uint64_t count_a = ((const ngram_t *)a)->count;
+    uint64_t count_b = ((const ngram_t *)b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+/* gathers the non-zero counters of one table and sorts them, most frequent
+ * first */
+static ngram_t *
+collect_ngrams(opcode_stats_t *stats, int length, int *count, uint64_t *total)
+{
+    int capacity = OPCODE_COUNT;
+    for (int i = 1; i < length; i++)
+        capacity *= OPCODE_COUNT;
+
+    ngram_t *ngrams = malloc(sizeof(ngram_t) * capacity);
+    if (ngrams == NULL)
+        exit(EXIT_FAILURE);
+
+    *count = 0;
+    *total = 0;
+    for (int i = 0; i < capacity; i++) {
+        uint64_t hits = length == 1   ? stats->singles[i]
+                        : length == 2 ? (&stats->pairs[0][0])[i]
+                                      : (&stats->triples[0][0][0])[i];
+        if (hits == 0)
+            continue;
+        ngram_t *ngram = &ngrams[(*count)++];
+        ngram->count = hits;
+        ngram->length = length;
+        for (int j = length - 1, rest = i; j >= 0; j--) {
+            ngram->ops[j] = (uint8_t)(rest % OPCODE_COUNT);
+            rest /= OPCODE_COUNT;
+        }
+        *total += hits;
+    }
+    qsort(ngrams, *count, sizeof(ngram_t), ngram_compare);
+    return ngrams;
+}
+
+static void
+write_text_section(FILE *out,
+                   opcode_stats_t *stats,
+                   const char *title,
+                   int length)
+{
+    int count;
+    uint64_t total;
+    ngram_t *ngrams = collect_ngrams(stats, length, &count, &total);
+
+    fprintf(out, "== %s (%llu total) ==\n", title, (unsigned long long)total);
+    for (int i = 0; i < count && i < STATS_TEXT_ROWS; i++) {
+        fprintf(out,
+                "%12llu %6.2f%% ",
+                (unsigned long long)ngrams[i].count,
+                100.0 * ngrams[i].count / total);
+        for (int j = 0; j < length; j++)
+            fprintf(out, " %s", opcode_names[ngrams[i].ops[j]]);
+        fprintf(out, "\n");
+    }
+    free(ngrams);
+}
+
+static void
+write_json_section(FILE *out,
+                   opcode_stats_t *stats,
+                   const char *title,
+                   int length,
+                   bool last)
+{
+    int count;
+    uint64_t total;
+    ngram_t *ngrams = collect_ngrams(stats, length, &count, &total);
+
+    fprintf(out,
+            "  \"%s\": {\n    \"total\": %llu,\n    \"counts\": [",
+            title,
+            (unsigned long long)total);
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\n      { \"ops\": [", i == 0 ? "" : ",");
+        for (int j = 0; j < length; j++)
+            fprintf(out,
+                    "%s\"%s\"",
+                    j == 0 ? "" : ", ",
+                    opcode_names[ngrams[i].ops[j]]);
+        fprintf(
+          out, "], \"count\": %llu }", (unsigned long long)ngrams[i].count);
+    }
+    fprintf(out, "\n    ]\n  }%s\n", last ? "" : ",");
+    free(ngrams);
+}
+
+/* writes the histograms of every VM added up to the file named by
+ * LOX_OPCODE_STATS, as JSON if the name ends in .json, or as text on
+ * stderr when it is unset */
+void
+write_opcode_stats(void)
+{
+    const char *path = getenv("LOX_OPCODE_STATS");
+    FILE *out = stderr;
+    if (path != NULL && (out = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    opcode_stats_t *stats = allocate_stats();
+    add_stats(stats, freed_stats);
+    for (opcode_stats_t *live = live_stats; live != NULL; live = live->next)
+        add_stats(stats, live);
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t length = path != NULL ? strlen(path) : 0;
+    if (length >= 5 && strcmp(path + length - 5, ".json") == 0) {
+        fprintf(out, "{\n");
+        write_json_section(out, stats, "opcodes", 1, false);
+        write_json_section(out, stats, "pairs", 2, false);
+        write_json_section(out, stats, "triples", 3, true);
+        fprintf(out, "}\n");
+    } else {
+        write_text_section(out, stats, "opcodes", 1);
+        write_text_section(out, stats, "pairs", 2);
+        write_text_section(out, stats, "triples", 3);
+    }
+
+    free(stats);
+    if (out != stderr)
+        fclose(out);
+}
+
+#endif /* DEBUG_OPCODE_STATS */
@@ -1,6 +1,8 @@
 #ifndef clox_debug_h
 #define clox_debug_h
 
+#include <stdint.h>
+
 #include "chunk.h"
 
 void
@@ -8,4 +10,17 @@ disassemble_chunk(chunk_t *, const char *name);
 int
 disassemble_instruction(chunk_t *, int offset);
 
+#ifdef DEBUG_OPCODE_STATS
+struct opcode_stats;
+
+struct opcode_stats *
+new_opcode_stats(void);
+void
+free_opcode_stats(struct opcode_stats *stats);
+void
+count_opcode(struct opcode_stats *stats, uint8_t op);
+void
+write_opcode_stats(void);
+#endif
+
 #endif /* clox_debug_h */
@@ -1,10 +1,15 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "bytecode.h"
+#include "memory.h"
+#include "pool.h"
 #include "vm.h"
 
 static void
-repl(void)
+repl(vm_t *context)
 {
     char line[1024];
     for (;;) {
@@ -13,7 +18,7 @@ repl(void)
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(context, line);
     }
 }
 
@@ -48,30 +53,111 @@ read_file(const char *path)
 }
 
 static void
-run_file(const char *path)
+run_file(vm_t *context, const char *path)
+{
+    interpret_result result = interpret_file(context, path);
+    if (result == INTERPRET_COMPILE_ERROR || result == INTERPRET_RUNTIME_ERROR)
+        exit(EXIT_FAILURE);
+}
+
+/* compiles the script at path into a .loxc file that can be run without
+ * the source */
+static void
+compile_file(vm_t *context, const char *path, const char *output)
 {
     char *source = read_file(path);
-    interpret_result result = interpret(source);
+    bool compiled = compile_bytecode(context, source, output);
     free(source);
+    if (!compiled)
+        exit(EXIT_FAILURE);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR || result == INTERPRET_RUNTIME_ERROR)
+/* runs the script at path and writes the heap it leaves behind to an
+ * image later runs can start from */
+static void
+snapshot_file(vm_t *context, const char *path, const char *output)
+{
+    run_file(context, path);
+    if (!write_image(context, output)) {
+        remove(output);
         exit(EXIT_FAILURE);
+    }
+}
+
+/* runs the script at path, then reports how long the collector paused it */
+static void
+profile_gc(vm_t *context, const char *path)
+{
+    interpret_result result = interpret_file(context, path);
+    fprint_gc_stats(stderr, &context->gc_stats);
+    if (result != INTERPRET_OK)
+        exit(EXIT_FAILURE);
+}
+
+/* runs every script in paths on thread_count threads, then prints what
+ * each printed in order. fails if any of them did */
+static void
+run_parallel(int thread_count, int count, const char *paths[])
+{
+    job_t *jobs = (job_t *)malloc(sizeof(job_t) * count);
+    if (jobs == NULL) {
+        fprintf(stderr, "Not enough memory for %d jobs.\n", count);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++)
+        jobs[i].path = paths[i];
+    run_jobs(jobs, count, thread_count);
+
+    bool failed = false;
+    for (int i = 0; i < count; i++) {
+        fwrite(jobs[i].output, 1, jobs[i].output_size, stdout);
+        fwrite(jobs[i].errors, 1, jobs[i].errors_size, stderr);
+        if (jobs[i].result != INTERPRET_OK)
+            failed = true;
+        free_job(&jobs[i]);
+    }
+    free(jobs);
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 int
 main(int argc, const char *argv[])
 {
-    vm_init();
+    if (argc >= 4 && strcmp(argv[1], "--jobs") == 0) {
+        int thread_count = atoi(argv[2]);
+        if (thread_count > 0)
+            run_parallel(thread_count, argc - 3, &argv[3]);
+    }
+
+    vm_t *context = new_vm();
 
     if (argc == 1)
-        repl();
+        repl(context);
     else if (argc == 2)
-        run_file(argv[1]);
-    else {
+        run_file(context, argv[1]);
+    else if (argc == 4 && strcmp(argv[1], "--compile") == 0)
+        compile_file(context, argv[2], argv[3]);
+    else if (argc == 4 && strcmp(argv[1], "--snapshot") == 0)
+        snapshot_file(context, argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "--gc-stats") == 0)
+        profile_gc(context, argv[2]);
+    else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--image") == 0) {
+        if (!load_image(context, argv[2]))
+            exit(EXIT_FAILURE);
+        if (argc == 3)
+            repl(context);
+        else
+            run_file(context, argv[3]);
+    } else {
         fprintf(stderr, "Usage: %s [path]\n", argv[0]);
+        fprintf(stderr, "       %s --compile path output\n", argv[0]);
+        fprintf(stderr, "       %s --snapshot path image\n", argv[0]);
+        fprintf(stderr, "       %s --image image [path]\n", argv[0]);
+        fprintf(stderr, "       %s --jobs threads path...\n", argv[0]);
+        fprintf(stderr, "       %s --gc-stats path\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    free_vm();
+    delete_vm(context);
     exit(EXIT_SUCCESS);
 }
@@ -1,63 +1,539 @@
 #include "memory.h"
+#include "bytecode.h"
 #include "compiler.h"
 #include "table.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #endif
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
+/* old objects are allocated from pages this big, aligned to their size so
+ * the page an object is in is found from its address */
+#define SLAB_PAGE_SIZE ((size_t)64 * 1024)
+/* how many pages are mapped from the system at once */
+#define SLAB_PAGE_BATCH 16
+/* the most slots a page can have, all of the smallest object size */
+#define SLAB_PAGE_SLOTS (SLAB_PAGE_SIZE / sizeof(obj_t))
+
+/* a page of slots of one size class. it starts with this header, which
+ * has a bit for every slot that holds an object and one for every object
+ * a major collection has marked, so marking doesn't write to the objects */
+typedef struct page
+{
+    /* the next page in the pool or waiting to be swept */
+    struct page *next;
+    /* where it is in vm->pages */
+    int index;
+    int slot_size;
+    int slot_count;
+    /* how many objects the last collection or sweep found in it */
+    int live_count;
+    /* being emptied by a compaction, its objects have left their new
+     * address in next */
+    bool moving;
+    char *slots;
+    /* the slots sweeping found free, in address order, and where the list
+     * ends so it can be joined onto the rest of its size class */
+    obj_t *free;
+    obj_t **free_end;
+    uint64_t allocated[SLAB_PAGE_SLOTS / 64];
+    uint64_t marks[SLAB_PAGE_SLOTS / 64];
+} page_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(page_t) + 15) & ~(size_t)15)
+
+struct gc_team;
+
+/* one of the threads a pause is split across. each marks from a gray stack
+ * of its own and shares the top half when another has run out */
+typedef struct
+{
+    struct gc_team *team;
+    pthread_t thread;
+    bool started;
+    int count;
+    int capacity;
+    obj_t **stack;
+    pthread_mutex_t lock;
+    int shared_count;
+    int shared_capacity;
+    obj_t **shared;
+    /* what it swept, taken off bytes_allocated once they're all done */
+    size_t freed;
+} gc_worker_t;
+
+typedef struct gc_team
+{
+    vm_t *vm;
+    int count;
+    gc_worker_t *workers;
+    atomic_int running;
+    atomic_int idle;
+    /* how many objects are shared between them all */
+    atomic_int available;
+    /* the pages being swept and the next one to hand out */
+    page_t **pages;
+    int page_count;
+    atomic_int next_page;
+} gc_team_t;
+
+/* the worker the calling thread is while a pause is split up */
+static _Thread_local gc_worker_t *worker;
+/* set while a compaction updates what points at the objects it moved */
+static _Thread_local bool compacting;
+
 const int GC_HEAP_GROW_FACTOR = 2;
+/* while marking, a slice is due every time the heap grows this much per
+ * object in the slice */
+const size_t GC_SLICE_BYTES = 32;
+/* after a major collection, a page is swept every time this much is
+ * allocated in the nursery so promotion mostly finds them swept already */
+const size_t GC_SWEEP_BYTES = 4 * 1024;
 
-void *
-reallocate(void *pointer, size_t old_size, size_t new_size)
+static uint64_t
+now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+/* the first four buckets are 0 to 3ns, the rest split each power of two
+ * in four */
+static int
+pause_bucket(uint64_t ns)
+{
+    if (ns < 4)
+        return (int)ns;
+    int bits = 2;
+    while (ns >> (bits + 1) != 0)
+        bits++;
+    return 4 * (bits - 1) + (int)(ns >> (bits - 2)) - 4;
+}
+
+/* the longest pause that lands in bucket */
+static uint64_t
+bucket_limit(int bucket)
+{
+    if (bucket < 4)
+        return (uint64_t)bucket;
+    int bits = bucket / 4 + 1;
+    return ((uint64_t)(5 + bucket % 4) << (bits - 2)) - 1;
+}
+
+static void
+record_pause(uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+    gc_stats_t *stats = &vm->gc_stats;
+    stats->pause_count++;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns)
+        stats->max_ns = ns;
+    stats->pauses[pause_bucket(ns)]++;
+}
+
+/* called as the heap grows. an incremental or concurrent collection leaves
+ * the work for the next safepoint unless the heap has run away from it */
+static void
+pace_collector(void)
 {
-    vm.bytes_allocated += new_size - old_size;
-    if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
+    if (!vm->gc_marking) {
+        uint64_t start = now_ns();
         garbage_collect();
+        record_pause(start);
+    }
+    vm->gc_pending = true;
 #endif
-        if (vm.bytes_allocated > vm.next_gc)
-            garbage_collect();
+    if (vm->bytes_allocated <= vm->next_gc)
+        return;
+    if ((vm->gc_slice > 0 || vm->gc_thread) &&
+        vm->bytes_allocated <= vm->gc_limit) {
+        vm->gc_pending = true;
+        return;
     }
+    uint64_t start = now_ns();
+    garbage_collect();
+    record_pause(start);
+}
 
+/* takes freed memory off the heap, or off what the worker sweeping it has
+ * freed so far */
+static void
+uncount(size_t size)
+{
+    if (worker != NULL)
+        worker->freed += size;
+    else
+        vm->bytes_allocated -= size;
+}
+
+void *
+reallocate(void *pointer, size_t old_size, size_t new_size)
+{
     if (new_size == 0) {
+        uncount(old_size);
         free(pointer);
         return NULL;
     }
 
+    vm->bytes_allocated += new_size - old_size;
+    if (new_size > old_size)
+        pace_collector();
+
     void *result = realloc(pointer, new_size);
     if (result == NULL)
         exit(EXIT_FAILURE);
     return result;
 }
 
+/* objects are laid out back to back in the nursery at this alignment */
+static size_t
+young_size(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+static void
+sweep_ahead(void);
+
+/* bumps an object out of the nursery, or returns NULL once it's full. the
+ * object counts towards the heap from here on so major collections are
+ * paced the same whichever generation it ends up in */
+void *
+nursery_allocate(size_t size)
+{
+    size_t aligned = young_size(size);
+    while (aligned > (size_t)(vm->nursery_limit - vm->nursery_top)) {
+        if (vm->nursery_limit == vm->nursery_end) {
+            vm->nursery_full = true;
+            vm->gc_pending = true;
+            return NULL;
+        }
+        sweep_ahead();
+    }
+
+    vm->bytes_allocated += size;
+    pace_collector();
+
+    void *result = vm->nursery_top;
+    vm->nursery_top += aligned;
+    return result;
+}
+
+static int
+size_class(size_t size)
+{
+    return (int)((size + 7) / 8) - 1;
+}
+
+static page_t *
+page_of(obj_t *object)
+{
+    return (page_t *)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static obj_t *
+page_slot(page_t *page, int index)
+{
+    return (obj_t *)(page->slots + (size_t)index * page->slot_size);
+}
+
+/* maps pages from the system a batch at a time, the spare ones go in the
+ * pool */
+static page_t *
+map_page(void)
+{
+    size_t size = (SLAB_PAGE_BATCH + 1) * SLAB_PAGE_SIZE;
+    char *start = (char *)mmap(
+      NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+        exit(EXIT_FAILURE);
+    /* trim it down to pages aligned to their size */
+    char *first = (char *)(((uintptr_t)start + SLAB_PAGE_SIZE - 1) &
+                           ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    char *end = first + SLAB_PAGE_BATCH * SLAB_PAGE_SIZE;
+    if (first > start)
+        munmap(start, (size_t)(first - start));
+    if (end < start + size)
+        munmap(end, (size_t)(start + size - end));
+
+    for (int i = 1; i < SLAB_PAGE_BATCH; i++) {
+        page_t *page = (page_t *)(first + i * SLAB_PAGE_SIZE);
+        page->next = vm->page_pool;
+        vm->page_pool = page;
+    }
+    return (page_t *)first;
+}
+
+/* how many slots a page of a size class has */
+static int
+class_slots(int class)
+{
+    size_t slot_size = (size_t)(class + 1) * 8;
+    return (int)((SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / slot_size);
+}
+
+/* gives a size class a page, all of it free and linked in address order */
+static void
+add_page(int class)
+{
+    page_t *page = vm->page_pool;
+    if (page != NULL)
+        vm->page_pool = page->next;
+    else
+        page = map_page();
+
+    page->slot_size = (class + 1) * 8;
+    page->slots = (char *)page + SLAB_HEADER_SIZE;
+    page->slot_count = class_slots(class);
+    page->live_count = 0;
+    page->moving = false;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marks, 0, sizeof(page->marks));
+    for (int i = 0; i < page->slot_count - 1; i++)
+        page_slot(page, i)->next = page_slot(page, i + 1);
+    page_slot(page, page->slot_count - 1)->next = vm->free_slots[class];
+    vm->free_slots[class] = page_slot(page, 0);
+
+    if (vm->page_capacity < vm->page_count + 1) {
+        int old_capacity = vm->page_capacity;
+        vm->page_capacity = grow_capacity(old_capacity);
+        vm->pages = (page_t **)realloc(vm->pages,
+                                       sizeof(page_t *) * vm->page_capacity);
+        if (vm->pages == NULL)
+            exit(EXIT_FAILURE);
+    }
+    page->index = vm->page_count;
+    vm->pages[vm->page_count++] = page;
+}
+
+/* puts a page with nothing left in it back in the pool */
+static void
+release_page(page_t *page)
+{
+    page_t *last = vm->pages[--vm->page_count];
+    last->index = page->index;
+    vm->pages[page->index] = last;
+    page->next = vm->page_pool;
+    vm->page_pool = page;
+}
+
+/* hands a swept page's free slots to its size class, or the page back to
+ * the pool if that's all it has */
+static void
+reuse_page(page_t *page)
+{
+    if (page->live_count == 0) {
+        release_page(page);
+        return;
+    }
+    if (page->free != NULL) {
+        int class = size_class((size_t)page->slot_size);
+        *page->free_end = vm->free_slots[class];
+        vm->free_slots[class] = page->free;
+    }
+}
+
+static int
+sweep_page(page_t *page);
+
+/* sets a mark bit, telling whether it was clear */
+static bool
+set_mark(uint64_t *word, uint64_t bit)
+{
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+        return false;
+    /* other threads may be marking objects next to it */
+    if (worker != NULL || vm->collector_running)
+        return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+    *word |= bit;
+    return true;
+}
+
+static void
+sweep_next(int class)
+{
+    page_t *page = vm->unswept[class];
+    vm->unswept[class] = page->next;
+    size_t before = vm->bytes_allocated;
+    size_t slots = (size_t)sweep_page(page) * (size_t)page->slot_size;
+    reuse_page(page);
+
+    /* the collection only took the slots of what it didn't mark off the
+     * heap when it worked out when the next one is due, what they held
+     * is only known now */
+    size_t held = before - vm->bytes_allocated - slots;
+    size_t early = held * GC_HEAP_GROW_FACTOR;
+    vm->next_gc = vm->next_gc > early ? vm->next_gc - early : 0;
+    vm->gc_limit = vm->next_gc + vm->next_gc / 2;
+}
+
+/* moves the nursery's limit up to the next page to sweep */
+static void
+limit_nursery(void)
+{
+    vm->nursery_limit = vm->nursery_end;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (vm->unswept[i] != NULL) {
+            size_t room = (size_t)(vm->nursery_end - vm->nursery_top);
+            if (room > GC_SWEEP_BYTES)
+                vm->nursery_limit = vm->nursery_top + GC_SWEEP_BYTES;
+            break;
+        }
+    }
+}
+
+/* sweeps a page of the first size class that has any left */
+static void
+sweep_ahead(void)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (vm->unswept[i] != NULL) {
+            sweep_next(i);
+            break;
+        }
+    }
+    limit_nursery();
+}
+
+/* takes a slot for an old object, which already counts towards the heap.
+ * a size class that's run out sweeps its pages until one has room */
+static obj_t *
+take_slot(size_t size)
+{
+    int class = size_class(size);
+    while (vm->free_slots[class] == NULL && vm->unswept[class] != NULL)
+        sweep_next(class);
+    if (vm->free_slots[class] == NULL)
+        add_page(class);
+    obj_t *slot = vm->free_slots[class];
+    vm->free_slots[class] = slot->next;
+
+    page_t *page = page_of(slot);
+    int index = (int)(((char *)slot - page->slots) / page->slot_size);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    page->allocated[index / 64] |= bit;
+    /* a major collection that's marking counts it as reachable */
+    if (vm->gc_marking)
+        set_mark(&page->marks[index / 64], bit);
+    return slot;
+}
+
+/* allocates an object straight into the old generation */
+void *
+slab_allocate(size_t size)
+{
+    vm->bytes_allocated += size;
+    pace_collector();
+    return take_slot(size);
+}
+
+void
+remember(obj_t *object)
+{
+    if (!object->is_old || object->is_remembered)
+        return;
+    object->is_remembered = true;
+
+    if (vm->remembered_capacity < vm->remembered_count + 1) {
+        vm->remembered_capacity = grow_capacity(vm->remembered_capacity);
+        vm->remembered = (obj_t **)realloc(
+          vm->remembered, sizeof(obj_t *) * vm->remembered_capacity);
+        if (vm->remembered == NULL)
+            exit(EXIT_FAILURE);
+    }
+    vm->remembered[vm->remembered_count++] = object;
+}
+
+static void
+push_gray(obj_t *object)
+{
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = grow_capacity(vm->gray_capacity);
+        vm->gray_stack = (obj_t **)realloc(
+          vm->gray_stack, sizeof(obj_t *) * vm->gray_capacity);
+        if (vm->gray_stack == NULL)
+            exit(EXIT_FAILURE);
+    }
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+static void
+push_work(gc_worker_t *self, obj_t *object)
+{
+    if (self->capacity < self->count + 1) {
+        self->capacity = grow_capacity(self->capacity);
+        self->stack =
+          (obj_t **)realloc(self->stack, sizeof(obj_t *) * self->capacity);
+        if (self->stack == NULL)
+            exit(EXIT_FAILURE);
+    }
+    self->stack[self->count++] = object;
+}
+
+/* where an object's mark bit is, in its page's bitmap or for a young one
+ * in the nursery's */
+static uint64_t *
+mark_word(obj_t *object, uint64_t *bit)
+{
+    if (!object->is_old) {
+        size_t index = (size_t)((char *)object - vm->nursery) / 8;
+        *bit = (uint64_t)1 << (index % 64);
+        return &vm->nursery_marks[index / 64];
+    }
+    page_t *page = page_of(object);
+    int index = (int)(((char *)object - page->slots) / page->slot_size);
+    *bit = (uint64_t)1 << (index % 64);
+    return &page->marks[index / 64];
+}
+
+bool
+is_marked(obj_t *object)
+{
+    uint64_t bit;
+    uint64_t *word = mark_word(object, &bit);
+    return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+}
+
 void
 mark_object(obj_t *object)
 {
-    if (object == NULL || object->is_marked)
+    if (object == NULL)
+        return;
+    /* young objects are newer than the collection that's marking */
+    if (!object->is_old && vm->gc_marking)
+        return;
+    /* whichever thread sets the mark first blackens it */
+    uint64_t bit;
+    uint64_t *word = mark_word(object, &bit);
+    if (!set_mark(word, bit))
         return;
+    if (worker != NULL) {
+        push_work(worker, object);
+        return;
+    }
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *)object);
     print_value(obj_val(object));
     printf("\n");
 #endif
-    object->is_marked = true;
-
-    if (vm.gray_capacity < vm.gray_count + 1) {
-        vm.gray_capacity = grow_capacity(vm.gray_capacity);
-        vm.gray_stack =
-          (obj_t **)realloc(vm.gray_stack, sizeof(obj_t *) * vm.gray_capacity);
-        if (vm.gray_stack == NULL)
-            exit(EXIT_FAILURE);
-    }
-    vm.gray_stack[vm.gray_count++] = object;
+    push_gray(object);
 }
 
 void
@@ -67,6 +543,42 @@ mark_value(value_t value)
         mark_object(as_obj(value));
 }
 
+/* what's overwritten while a major collection is marking may have been
+ * reachable when it began */
+void
+shade(value_t value)
+{
+    if (vm->gc_marking)
+        mark_value(value);
+}
+
+/* write_field's way for an old object */
+void
+write_old_field(obj_t *object, value_t *field, value_t value)
+{
+    bool marking = begin_write(object);
+    if (marking)
+        shade(*field);
+    *field = value;
+    end_write(marking);
+    write_barrier(object, value);
+}
+
+/* table_set on a table object owns */
+bool
+write_entry(obj_t *object, table_t *table, obj_string *key, value_t value)
+{
+    bool marking = begin_write(object);
+    value_t old;
+    if (marking && table_get(table, key, &old))
+        shade(old);
+    bool is_new = table_set(table, key, value);
+    end_write(marking);
+    write_barrier(object, obj_val((obj_t *)key));
+    write_barrier(object, value);
+    return is_new;
+}
+
 static void
 mark_array(value_array *array)
 {
@@ -74,6 +586,25 @@ mark_array(value_array *array)
         mark_value(array->values[i]);
 }
 
+/* cached shapes and classes are held strongly so a freed one can never be
+ * mistaken for a new one allocated at the same address */
+static void
+mark_caches(chunk_t *chunk)
+{
+    for (int i = 0; i < chunk->cache_count; i++) {
+        inline_cache_t *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count && j < PROPERTY_CACHE_WAYS; j++) {
+            mark_object((obj_t *)cache->entries[j].shape);
+            mark_object((obj_t *)cache->entries[j].next_shape);
+            mark_value(cache->entries[j].method);
+        }
+    }
+    for (int i = 0; i < chunk->method_cache_count; i++) {
+        mark_object((obj_t *)chunk->method_caches[i].class);
+        mark_value(chunk->method_caches[i].method);
+    }
+}
+
 static void
 blacken_object(obj_t *object)
 {
@@ -94,6 +625,7 @@ blacken_object(obj_t *object)
             obj_class *class = (obj_class *)object;
             mark_object((obj_t *)class->name);
             table_mark(&class->methods);
+            mark_object((obj_t *)class->root_shape);
             break;
         }
         case OBJ_CLOSURE: {
@@ -107,12 +639,26 @@ blacken_object(obj_t *object)
             obj_function *function = (obj_function *)object;
             mark_object((obj_t *)function->name);
             mark_array(&function->chunk.constants);
+            mark_caches(&function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             obj_instance *instance = (obj_instance *)object;
             mark_object((obj_t *)instance->class);
-            table_mark(&instance->fields);
+            if (instance->shape == NULL) {
+                table_mark(instance->dictionary);
+                break;
+            }
+            mark_object((obj_t *)instance->shape);
+            for (int i = 0; i < instance->shape->slot_count; i++)
+                mark_value(instance->fields[i]);
+            break;
+        }
+        case OBJ_SHAPE: {
+            obj_shape *shape = (obj_shape *)object;
+            mark_object((obj_t *)shape->parent);
+            mark_object((obj_t *)shape->key);
+            table_mark(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
@@ -124,137 +670,1029 @@ blacken_object(obj_t *object)
     }
 }
 
+static size_t
+object_size(obj_type_t type)
+{
+    switch (type) {
+        case OBJ_BOUND_METHOD:
+            return sizeof(obj_bound_method);
+        case OBJ_CLASS:
+            return sizeof(obj_class);
+        case OBJ_CLOSURE:
+            return sizeof(obj_closure);
+        case OBJ_FUNCTION:
+            return sizeof(obj_function);
+        case OBJ_INSTANCE:
+            return sizeof(obj_instance);
+        case OBJ_NATIVE:
+            return sizeof(obj_native);
+        case OBJ_SHAPE:
+            return sizeof(obj_shape);
+        case OBJ_STRING:
+            return sizeof(obj_string);
+        case OBJ_UPVALUE:
+            return sizeof(obj_upvalue);
+    }
+    return 0;
+}
+
+/* frees what the object owns but not the object itself */
 static void
-object_free(obj_t *object)
+free_contents(obj_t *object)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void *)object, object->type);
 #endif
 
     switch (object->type) {
+        case OBJ_CLASS:
+            table_free(&((obj_class *)object)->methods);
+            break;
+        case OBJ_CLOSURE: {
+            obj_closure *closure = (obj_closure *)object;
+            FREE_ARRAY(
+              obj_upvalue *, closure->upvalues, closure->upvalue_count);
+            break;
+        }
+        case OBJ_FUNCTION:
+            free_chunk(&((obj_function *)object)->chunk);
+            break;
+        case OBJ_INSTANCE: {
+            obj_instance *instance = (obj_instance *)object;
+            FREE_ARRAY(value_t, instance->fields, instance->field_capacity);
+            if (instance->dictionary != NULL) {
+                table_free(instance->dictionary);
+                FREE(table_t, instance->dictionary);
+            }
+            break;
+        }
+        case OBJ_SHAPE:
+            table_free(&((obj_shape *)object)->transitions);
+            break;
+        case OBJ_STRING: {
+            obj_string *string = (obj_string *)object;
+            FREE_ARRAY(char, string->chars, string->length + 1);
+            break;
+        }
         case OBJ_BOUND_METHOD:
-            FREE(obj_bound_method, object);
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+            break;
+    }
+}
+
+static void
+object_free(obj_t *object)
+{
+    free_contents(object);
+    uncount(object_size(object->type));
+}
+
+/* the object allocated after this one in the nursery */
+static obj_t *
+next_young(obj_t *object)
+{
+    return (obj_t *)((char *)object + young_size(object_size(object->type)));
+}
+
+/* a minor collection copies every young object reachable from the roots or
+ * the remembered set out of the nursery and then empties it, so it never
+ * looks at the rest of the old generation. young objects start out with
+ * next NULL, a copied one leaves its new address there. a major collection
+ * that's marking counts the copy as reachable */
+static obj_t *
+promote(obj_t *object)
+{
+    size_t size = object_size(object->type);
+    obj_t *copy = take_slot(size);
+    memcpy(copy, object, size);
+    copy->is_old = true;
+    copy->is_remembered = false;
+    if (object->type == OBJ_UPVALUE) {
+        obj_upvalue *upvalue = (obj_upvalue *)copy;
+        if (upvalue->location == &((obj_upvalue *)object)->closed)
+            upvalue->location = &upvalue->closed;
+    }
+
+    object->next = copy;
+    push_gray(copy);
+    return copy;
+}
+
+/* where an object is once a minor collection or a compaction is done with
+ * it. an old object a compaction moved left its new address in next too */
+obj_t *
+forward_object(obj_t *object)
+{
+    if (object == NULL)
+        return object;
+    if (object->is_old) {
+        if (compacting && page_of(object)->moving)
+            return object->next;
+        return object;
+    }
+    if (object->next != NULL)
+        return object->next;
+    return promote(object);
+}
+
+#define FORWARD(pointer)                                                      \
+    ((pointer) = (void *)forward_object((obj_t *)(pointer)))
+
+void
+forward_value(value_t *value)
+{
+    if (is_obj(*value))
+        *value = obj_val(forward_object(as_obj(*value)));
+}
+
+static void
+forward_table(table_t *table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        entry_t *entry = &table->entries[i];
+        if (entry->key != NULL) {
+            FORWARD(entry->key);
+            forward_value(&entry->value);
+        }
+    }
+}
+
+static void
+forward_caches(chunk_t *chunk)
+{
+    for (int i = 0; i < chunk->cache_count; i++) {
+        inline_cache_t *cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count && j < PROPERTY_CACHE_WAYS; j++) {
+            FORWARD(cache->entries[j].shape);
+            FORWARD(cache->entries[j].next_shape);
+            forward_value(&cache->entries[j].method);
+        }
+    }
+    for (int i = 0; i < chunk->method_cache_count; i++) {
+        FORWARD(chunk->method_caches[i].class);
+        forward_value(&chunk->method_caches[i].method);
+    }
+}
+
+/* the minor collection's blacken_object */
+static void
+forward_references(obj_t *object)
+{
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            obj_bound_method *bound = (obj_bound_method *)object;
+            forward_value(&bound->receiver);
+            FORWARD(bound->method);
             break;
+        }
         case OBJ_CLASS: {
             obj_class *class = (obj_class *)object;
-            table_free(&class->methods);
-            FREE(obj_class, object);
+            FORWARD(class->name);
+            forward_table(&class->methods);
+            FORWARD(class->root_shape);
             break;
         }
         case OBJ_CLOSURE: {
             obj_closure *closure = (obj_closure *)object;
-            FREE_ARRAY(
-              obj_upvalue *, closure->upvalues, closure->upvalue_count);
-            FREE(obj_closure, object);
+            FORWARD(closure->function);
+            for (int i = 0; i < closure->upvalue_count; i++)
+                FORWARD(closure->upvalues[i]);
             break;
         }
         case OBJ_FUNCTION: {
             obj_function *function = (obj_function *)object;
-            free_chunk(&function->chunk);
-            FREE(obj_function, object);
+            FORWARD(function->name);
+            for (int i = 0; i < function->chunk.constants.count; i++)
+                forward_value(&function->chunk.constants.values[i]);
+            forward_caches(&function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             obj_instance *instance = (obj_instance *)object;
-            table_free(&instance->fields);
-            FREE(obj_instance, object);
+            FORWARD(instance->class);
+            if (instance->shape == NULL) {
+                forward_table(instance->dictionary);
+                break;
+            }
+            FORWARD(instance->shape);
+            for (int i = 0; i < instance->shape->slot_count; i++)
+                forward_value(&instance->fields[i]);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(obj_native, object);
-            break;
-        case OBJ_STRING: {
-            obj_string *string = (obj_string *)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(obj_string, object);
+        case OBJ_SHAPE: {
+            obj_shape *shape = (obj_shape *)object;
+            FORWARD(shape->parent);
+            FORWARD(shape->key);
+            forward_table(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
-            FREE(obj_upvalue, object);
+            /* next only matters while open, open_upvalues is walked as a
+             * root for that */
+            forward_value(&((obj_upvalue *)object)->closed);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
             break;
     }
 }
 
+/* the compiler and the loaders never run with a minor collection pending,
+ * only run() starts one, so their roots can't be young here. a compaction
+ * forwards them itself */
+static void
+forward_roots(void)
+{
+    for (value_t *slot = vm->stack; slot < vm->stack_top; slot++)
+        forward_value(slot);
+    for (int i = 0; i < vm->frame_count; i++)
+        FORWARD(vm->frames[i].closure);
+    for (obj_upvalue **link = &vm->open_upvalues; *link != NULL;
+         link = &(*link)->next)
+        FORWARD(*link);
+    for (int i = 0; i < vm->globals.count; i++) {
+        forward_value(&vm->global_names.values[i]);
+        forward_value(&vm->globals.values[i]);
+    }
+    forward_table(&vm->global_slots);
+    FORWARD(vm->init_string);
+
+    for (int i = 0; i < vm->remembered_count; i++) {
+        vm->remembered[i]->is_remembered = false;
+        forward_references(vm->remembered[i]);
+    }
+    vm->remembered_count = 0;
+}
+
+void
+collect_nursery(void)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm->bytes_allocated;
+#endif
+
+    /* anything already on the gray stack is old and belongs to the marker */
+    int marking = vm->gray_count;
+    forward_roots();
+    while (vm->gray_count > marking)
+        forward_references(vm->gray_stack[--vm->gray_count]);
+
+    /* interned strings are weak, they follow their copy or go with it */
+    for (obj_t *object = (obj_t *)vm->nursery;
+         (char *)object < vm->nursery_top;
+         object = next_young(object)) {
+        if (object->next != NULL) {
+            if (object->type == OBJ_STRING)
+                table_rekey(&vm->strings,
+                            (obj_string *)object,
+                            (obj_string *)object->next);
+            continue;
+        }
+        if (object->type == OBJ_STRING)
+            table_delete(&vm->strings, (obj_string *)object);
+        free_contents(object);
+        vm->bytes_allocated -= object_size(object->type);
+    }
+#ifdef DEBUG_STRESS_GC
+    /* anything still pointing in here was missed by a write barrier, make
+     * it fall over straight away */
+    memset(vm->nursery, 0xdb, (size_t)(vm->nursery_top - vm->nursery));
+#endif
+    vm->nursery_top = vm->nursery;
+    limit_nursery();
+    vm->nursery_full = false;
+    vm->gc_stats.minor_count++;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+           before - vm->bytes_allocated,
+           before,
+           vm->bytes_allocated);
+#endif
+}
+
 static void
 mark_roots(void)
 {
-    for (value_t *slot = vm.stack; slot < vm.stack_top; slot++)
+    for (value_t *slot = vm->stack; slot < vm->stack_top; slot++)
         mark_value(*slot);
-    for (int i = 0; i < vm.frame_count; i++)
-        mark_object((obj_t *)vm.frames[i].closure);
-    for (obj_upvalue *upvalue = vm.open_upvalues; upvalue != NULL;
+    for (int i = 0; i < vm->frame_count; i++)
+        mark_object((obj_t *)vm->frames[i].closure);
+    for (obj_upvalue *upvalue = vm->open_upvalues; upvalue != NULL;
          upvalue = upvalue->next)
         mark_object((obj_t *)upvalue);
-    table_mark(&vm.globals);
+    for (int i = 0; i < vm->globals.count; i++) {
+        mark_value(vm->global_names.values[i]);
+        mark_value(vm->globals.values[i]);
+    }
     mark_compiler_roots();
-    mark_object((obj_t *)vm.init_string);
+    mark_bytecode_roots();
+    mark_object((obj_t *)vm->init_string);
 }
 
 static void
 trace_references(void)
 {
-    while (vm.gray_count > 0) {
-        obj_t *object = vm.gray_stack[--vm.gray_count];
+    while (vm->gray_count > 0) {
+        obj_t *object = vm->gray_stack[--vm->gray_count];
         blacken_object(object);
     }
 }
 
+/* a heap this big is marked and swept by gc_workers threads */
+static bool
+in_parallel(void)
+{
+    return vm->gc_workers > 1 && vm->bytes_allocated >= GC_PARALLEL_BYTES;
+}
+
+static void
+start_team(gc_team_t *team)
+{
+    team->vm = vm;
+    team->count = vm->gc_workers;
+    team->workers = (gc_worker_t *)calloc(team->count, sizeof(gc_worker_t));
+    if (team->workers == NULL)
+        exit(EXIT_FAILURE);
+    for (int i = 0; i < team->count; i++) {
+        team->workers[i].team = team;
+        pthread_mutex_init(&team->workers[i].lock, NULL);
+    }
+    atomic_init(&team->running, 0);
+    atomic_init(&team->idle, 0);
+    atomic_init(&team->available, 0);
+    team->pages = NULL;
+    team->page_count = 0;
+    atomic_init(&team->next_page, 0);
+}
+
+/* runs work on every worker, this thread being the first. a thread that
+ * can't be started just leaves more for the others */
+static void
+run_team(gc_team_t *team, void *(*work)(void *))
+{
+    for (int i = 1; i < team->count; i++) {
+        gc_worker_t *other = &team->workers[i];
+        other->started =
+          pthread_create(&other->thread, NULL, work, other) == 0;
+    }
+    work(&team->workers[0]);
+    for (int i = 1; i < team->count; i++)
+        if (team->workers[i].started)
+            pthread_join(team->workers[i].thread, NULL);
+    worker = NULL;
+}
+
 static void
-sweep(void)
+end_team(gc_team_t *team)
 {
-    obj_t *previous = NULL;
-    obj_t *object = vm.objects;
-    while (object != NULL) {
-        if (object->is_marked) {
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
+    for (int i = 0; i < team->count; i++) {
+        gc_worker_t *member = &team->workers[i];
+        vm->bytes_allocated -= member->freed;
+        pthread_mutex_destroy(&member->lock);
+        free(member->stack);
+        free(member->shared);
+    }
+    free(team->workers);
+}
+
+static void
+share_work(gc_worker_t *self)
+{
+    pthread_mutex_lock(&self->lock);
+    if (self->shared_count == 0) {
+        int half = self->count / 2;
+        if (self->shared_capacity < half) {
+            self->shared_capacity = half;
+            self->shared = (obj_t **)realloc(
+              self->shared, sizeof(obj_t *) * self->shared_capacity);
+            if (self->shared == NULL)
+                exit(EXIT_FAILURE);
+        }
+        self->count -= half;
+        memcpy(
+          self->shared, self->stack + self->count, sizeof(obj_t *) * half);
+        self->shared_count = half;
+        atomic_fetch_add(&self->team->available, half);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/* takes half of what some worker has shared, trying its own first */
+static bool
+steal_work(gc_worker_t *self)
+{
+    gc_team_t *team = self->team;
+    int first = (int)(self - team->workers);
+    for (int i = 0; i < team->count; i++) {
+        gc_worker_t *victim = &team->workers[(first + i) % team->count];
+        pthread_mutex_lock(&victim->lock);
+        int taken = (victim->shared_count + 1) / 2;
+        victim->shared_count -= taken;
+        for (int j = 0; j < taken; j++)
+            push_work(self, victim->shared[victim->shared_count + j]);
+        pthread_mutex_unlock(&victim->lock);
+        if (taken > 0) {
+            atomic_fetch_sub(&team->available, taken);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *
+mark_work(void *argument)
+{
+    gc_worker_t *self = (gc_worker_t *)argument;
+    gc_team_t *team = self->team;
+    vm = team->vm;
+    worker = self;
+    atomic_fetch_add(&team->running, 1);
+    for (;;) {
+        while (self->count > 0) {
+            blacken_object(self->stack[--self->count]);
+            if (self->count > 1 &&
+                atomic_load_explicit(&team->idle, memory_order_relaxed) > 0 &&
+                atomic_load_explicit(&team->available,
+                                     memory_order_relaxed) == 0)
+                share_work(self);
+        }
+        if (steal_work(self))
             continue;
+
+        /* only a busy worker shares anything, so once they're all idle
+         * the marking is done */
+        atomic_fetch_add(&team->idle, 1);
+        while (atomic_load(&team->available) == 0) {
+            if (atomic_load(&team->idle) == atomic_load(&team->running) &&
+                atomic_load(&team->available) == 0)
+                return NULL;
+            sched_yield();
         }
+        atomic_fetch_sub(&team->idle, 1);
+    }
+}
 
-        obj_t *unreached = object;
-        object = object->next;
-        if (previous != NULL)
-            previous->next = object;
-        else
-            vm.objects = object;
-        object_free(unreached);
+/* trace_references() with the work split across gc_workers threads */
+static void
+trace_in_parallel(void)
+{
+    gc_team_t team;
+    start_team(&team);
+    for (int i = 0; i < vm->gray_count; i++)
+        push_work(&team.workers[0], vm->gray_stack[i]);
+    vm->gray_count = 0;
+    run_team(&team, mark_work);
+    end_team(&team);
+}
+
+/* frees what a collection didn't mark in a page and lists every free slot
+ * in address order, a bitmap word at a time. tells how many it freed */
+static int
+sweep_page(page_t *page)
+{
+    obj_t **free_end = &page->free;
+    int freed = 0;
+    page->live_count = 0;
+    for (int word = 0; word * 64 < page->slot_count; word++) {
+        int first = word * 64;
+        uint64_t live = page->allocated[word] & page->marks[word];
+        for (uint64_t dead = page->allocated[word] & ~live; dead != 0;
+             dead &= dead - 1) {
+            obj_t *object = page_slot(page, first + __builtin_ctzll(dead));
+            object_free(object);
+            freed++;
+#ifdef DEBUG_STRESS_GC
+            /* make anything still pointing here fall over straight away */
+            memset(object, 0xdb, (size_t)page->slot_size);
+#endif
+        }
+        page->allocated[word] = live;
+        page->marks[word] = 0;
+        page->live_count += __builtin_popcountll(live);
+
+        uint64_t free = ~live;
+        if (page->slot_count - first < 64)
+            free &= ((uint64_t)1 << (page->slot_count - first)) - 1;
+        for (; free != 0; free &= free - 1) {
+            obj_t *slot = page_slot(page, first + __builtin_ctzll(free));
+            *free_end = slot;
+            free_end = &slot->next;
+        }
     }
+    *free_end = NULL;
+    page->free_end = free_end;
+    return freed;
 }
 
+static void *
+sweep_work(void *argument)
+{
+    gc_worker_t *self = (gc_worker_t *)argument;
+    gc_team_t *team = self->team;
+    vm = team->vm;
+    worker = self;
+    for (int page; (page = atomic_fetch_add(&team->next_page, 1)) <
+                   team->page_count;)
+        sweep_page(team->pages[page]);
+    return NULL;
+}
+
+/* sweeps the pages the allocator hasn't got to since the last collection,
+ * which has to be done before the next one marks */
+static void
+finish_sweeping(void)
+{
+    int count = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        for (page_t *page = vm->unswept[i]; page != NULL; page = page->next)
+            count++;
+    if (count == 0)
+        return;
+
+    page_t **pages = (page_t **)malloc(sizeof(page_t *) * (size_t)count);
+    if (pages == NULL)
+        exit(EXIT_FAILURE);
+    count = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        for (page_t *page = vm->unswept[i]; page != NULL; page = page->next)
+            pages[count++] = page;
+        vm->unswept[i] = NULL;
+    }
+
+    if (in_parallel()) {
+        gc_team_t team;
+        start_team(&team);
+        team.pages = pages;
+        team.page_count = count;
+        run_team(&team, sweep_work);
+        end_team(&team);
+    } else {
+        for (int i = 0; i < count; i++)
+            sweep_page(pages[i]);
+    }
+    for (int i = 0; i < count; i++)
+        reuse_page(pages[i]);
+    free(pages);
+    vm->nursery_limit = vm->nursery_end;
+}
+
+/* leaves every page to be swept when its size class next runs out of
+ * room, which starts the free lists over, and tells how many bytes of
+ * objects weren't marked */
+static size_t
+defer_sweeping(void)
+{
+    size_t unmarked = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        vm->free_slots[i] = NULL;
+    for (int i = vm->page_count - 1; i >= 0; i--) {
+        page_t *page = vm->pages[i];
+        int dead = 0;
+        page->live_count = 0;
+        for (int word = 0; word * 64 < page->slot_count; word++) {
+            dead += __builtin_popcountll(page->allocated[word] &
+                                         ~page->marks[word]);
+            page->live_count += __builtin_popcountll(page->allocated[word] &
+                                                     page->marks[word]);
+        }
+        unmarked += (size_t)dead * (size_t)page->slot_size;
+
+        int class = size_class((size_t)page->slot_size);
+        page->next = vm->unswept[class];
+        vm->unswept[class] = page;
+    }
+    return unmarked;
+}
+
+/* how many pages compacting the old generation would give back, going by
+ * what each page has live */
+static int
+spare_pages(void)
+{
+    int live[SLAB_CLASSES] = { 0 };
+    for (int i = 0; i < vm->page_count; i++) {
+        page_t *page = vm->pages[i];
+        live[size_class((size_t)page->slot_size)] += page->live_count;
+    }
+    int spare = vm->page_count;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        spare -= (live[i] + class_slots(i) - 1) / class_slots(i);
+    return spare;
+}
+
+/* marks everything left to mark and leaves the pages to be swept,
+ * finishing an incremental or concurrent collection if one is underway.
+ * that one marked the roots as it began and only has what was shaded
+ * since left to look at */
 void
 garbage_collect(void)
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    size_t before = vm->bytes_allocated;
 #endif
 
-    mark_roots();
-    trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    lock_heap();
+    if (!vm->gc_marking) {
+        vm->gc_stats.major_count++;
+        finish_sweeping();
+        mark_roots();
+    }
+    if (in_parallel())
+        trace_in_parallel();
+    else
+        trace_references();
+    table_remove_white(&vm->strings);
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    /* the remembered set only has to keep the old objects that survive */
+    int remembered = 0;
+    for (int i = 0; i < vm->remembered_count; i++)
+        if (is_marked(vm->remembered[i]))
+            vm->remembered[remembered++] = vm->remembered[i];
+    vm->remembered_count = remembered;
+
+    size_t unmarked = defer_sweeping();
+    limit_nursery();
+    /* compacting a heap that's this fragmented is left to the next
+     * safepoint. a batch of pages is the least it's worth doing for */
+    if (vm->gc_compact > 0) {
+        int spare = spare_pages();
+        if (spare >= SLAB_PAGE_BATCH &&
+            spare * 100 >= vm->gc_compact * vm->page_count) {
+            vm->compact_pending = true;
+            vm->gc_pending = true;
+        }
+    }
+    /* dead young objects stay in the nursery until the next minor
+     * collection frees what they own */
+    size_t young_words =
+      ((size_t)(vm->nursery_top - vm->nursery) / 8 + 63) / 64;
+    memset(vm->nursery_marks, 0, sizeof(uint64_t) * young_words);
+
+    vm->gc_marking = false;
+    vm->next_gc = (vm->bytes_allocated - unmarked) * GC_HEAP_GROW_FACTOR;
+    vm->gc_limit = vm->next_gc + vm->next_gc / 2;
+    unlock_heap();
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytes_allocated,
+    printf("   found %zu bytes unreachable (from %zu to %zu) next at %zu\n",
+           unmarked,
            before,
-           vm.bytes_allocated,
-           vm.next_gc);
+           vm->bytes_allocated - unmarked,
+           vm->next_gc);
 #endif
 }
 
+static void
+mark_slice(void)
+{
+    for (int work = 0; work < vm->gc_slice && vm->gray_count > 0; work++)
+        blacken_object(vm->gray_stack[--vm->gray_count]);
+    if (vm->gray_count == 0) {
+        garbage_collect();
+        return;
+    }
+    vm->next_gc = vm->bytes_allocated + GC_SLICE_BYTES * vm->gc_slice;
+}
+
+/* the collector thread holds gc_lock while it marks and hands it over
+ * between objects when this thread asks for it */
+void
+lock_heap(void)
+{
+    if (!vm->collector_running || vm->gc_lock_depth++ > 0)
+        return;
+    vm->gc_lock_wanted = true;
+    pthread_mutex_lock(&vm->gc_lock);
+    vm->gc_lock_wanted = false;
+}
+
+void
+unlock_heap(void)
+{
+    if (!vm->collector_running || --vm->gc_lock_depth > 0)
+        return;
+    if (vm->collector_yielded) {
+        vm->collector_yielded = false;
+        pthread_cond_signal(&vm->collector_resume);
+    }
+    pthread_mutex_unlock(&vm->gc_lock);
+}
+
+static void *
+collector_main(void *context)
+{
+    vm = (vm_t *)context;
+    pthread_mutex_lock(&vm->gc_lock);
+    while (!vm->collector_stop) {
+        if (!vm->gc_marking || vm->gray_count == 0) {
+            pthread_cond_wait(&vm->collector_wake, &vm->gc_lock);
+            continue;
+        }
+        blacken_object(vm->gray_stack[--vm->gray_count]);
+        /* the final pause only has to look at what's shaded from now on */
+        if (vm->gray_count == 0)
+            vm->gc_pending = true;
+        while (vm->gc_lock_wanted && !vm->collector_stop) {
+            vm->collector_yielded = true;
+            pthread_cond_wait(&vm->collector_resume, &vm->gc_lock);
+        }
+    }
+    pthread_mutex_unlock(&vm->gc_lock);
+    return NULL;
+}
+
+/* a VM that can't have a thread marks at safepoints instead */
+static void
+start_collector(void)
+{
+    if (vm->collector_running)
+        return;
+    pthread_mutex_init(&vm->gc_lock, NULL);
+    pthread_cond_init(&vm->collector_wake, NULL);
+    pthread_cond_init(&vm->collector_resume, NULL);
+    vm->collector_stop = false;
+    if (pthread_create(&vm->collector, NULL, collector_main, vm) != 0) {
+        pthread_cond_destroy(&vm->collector_resume);
+        pthread_cond_destroy(&vm->collector_wake);
+        pthread_mutex_destroy(&vm->gc_lock);
+        vm->gc_thread = false;
+        return;
+    }
+    vm->collector_running = true;
+}
+
+static void
+stop_collector(void)
+{
+    if (!vm->collector_running)
+        return;
+    lock_heap();
+    vm->collector_stop = true;
+    pthread_cond_signal(&vm->collector_wake);
+    unlock_heap();
+    pthread_join(vm->collector, NULL);
+    pthread_cond_destroy(&vm->collector_resume);
+    pthread_cond_destroy(&vm->collector_wake);
+    pthread_mutex_destroy(&vm->gc_lock);
+    vm->collector_running = false;
+}
+
+/* fullest first */
+static int
+by_live_count(const void *left, const void *right)
+{
+    int a = (*(page_t *const *)left)->live_count;
+    int b = (*(page_t *const *)right)->live_count;
+    return (b > a) - (b < a);
+}
+
+/* moves what's in the emptiest pages of a size class into the free slots
+ * of the fullest, as few as will hold it all, and tells whether anything
+ * moved. pages has room for every page */
+static bool
+compact_class(int class, page_t **pages)
+{
+    int count = 0;
+    int live = 0;
+    for (int i = 0; i < vm->page_count; i++) {
+        page_t *page = vm->pages[i];
+        if (page->slot_size != (class + 1) * 8)
+            continue;
+        /* objects since taken from a swept page aren't counted yet */
+        page->live_count = 0;
+        for (int word = 0; word * 64 < page->slot_count; word++)
+            page->live_count += __builtin_popcountll(page->allocated[word]);
+        live += page->live_count;
+        pages[count++] = page;
+    }
+    int keep = (live + class_slots(class) - 1) / class_slots(class);
+    if (keep == count)
+        return false;
+
+    qsort(pages, (size_t)count, sizeof(page_t *), by_live_count);
+    for (int i = keep; i < count; i++)
+        pages[i]->moving = true;
+    /* only the pages that stay have slots to give */
+    for (obj_t **link = &vm->free_slots[class]; *link != NULL;) {
+        if (page_of(*link)->moving)
+            *link = (*link)->next;
+        else
+            link = &(*link)->next;
+    }
+
+    for (int i = keep; i < count; i++) {
+        page_t *page = pages[i];
+        for (int word = 0; word * 64 < page->slot_count; word++) {
+            for (uint64_t left = page->allocated[word]; left != 0;
+                 left &= left - 1) {
+                obj_t *object =
+                  page_slot(page, word * 64 + __builtin_ctzll(left));
+                obj_t *copy = take_slot((size_t)page->slot_size);
+                memcpy(copy, object, (size_t)page->slot_size);
+                if (object->type == OBJ_UPVALUE) {
+                    obj_upvalue *upvalue = (obj_upvalue *)copy;
+                    if (upvalue->location == &((obj_upvalue *)object)->closed)
+                        upvalue->location = &upvalue->closed;
+                }
+                object->next = copy;
+            }
+        }
+    }
+    return true;
+}
+
+/* points everything at where the objects compact_class() moved went */
+static void
+forward_moved(void)
+{
+    compacting = true;
+    forward_roots();
+    forward_table(&vm->strings);
+    forward_compiler_roots();
+    forward_bytecode_roots();
+    for (int i = 0; i < vm->page_count; i++) {
+        page_t *page = vm->pages[i];
+        if (page->moving)
+            continue;
+        for (int word = 0; word * 64 < page->slot_count; word++)
+            for (uint64_t left = page->allocated[word]; left != 0;
+                 left &= left - 1)
+                forward_references(
+                  page_slot(page, word * 64 + __builtin_ctzll(left)));
+    }
+    compacting = false;
+}
+
+/* a compaction collects the whole heap and then moves the old generation
+ * into as few pages as will hold it. every page that's left empty goes
+ * back to the system, so memory taken by a spike in the heap isn't kept
+ * for good */
+static void
+compact_heap(void)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc compact\n");
+#endif
+    collect_nursery();
+    garbage_collect();
+    finish_sweeping();
+    vm->compact_pending = false;
+    vm->gc_stats.compact_count++;
+
+    page_t **pages = (page_t **)malloc(sizeof(page_t *) *
+                                       (size_t)(vm->page_count + 1));
+    if (pages == NULL)
+        exit(EXIT_FAILURE);
+    bool moved = false;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        moved |= compact_class(i, pages);
+    free(pages);
+
+    if (moved) {
+        forward_moved();
+        /* release_page() moves the last page into the one it takes out */
+        for (int i = vm->page_count - 1; i >= 0; i--) {
+            page_t *page = vm->pages[i];
+            if (!page->moving)
+                continue;
+#ifdef DEBUG_STRESS_GC
+            memset(page->slots, 0xdb,
+                   (size_t)page->slot_count * (size_t)page->slot_size);
+#endif
+            release_page(page);
+        }
+    }
+    while (vm->page_pool != NULL) {
+        page_t *page = vm->page_pool;
+        vm->page_pool = page->next;
+        munmap(page, SLAB_PAGE_SIZE);
+    }
+
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    vm->gc_limit = vm->next_gc + vm->next_gc / 2;
+}
+
+/* run() calls this between instructions once gc_pending is set. minor
+ * collections and the pauses of an incremental or concurrent major one
+ * only happen here, where no object is held anywhere the collector doesn't
+ * look */
+void
+collect_at_safepoint(void)
+{
+    uint64_t start = now_ns();
+    vm->gc_pending = false;
+    if (vm->compact_pending) {
+        lock_heap();
+        compact_heap();
+        unlock_heap();
+        record_pause(start);
+        return;
+    }
+    bool minor = vm->nursery_full;
+    bool major = vm->bytes_allocated > vm->next_gc;
+#ifdef DEBUG_STRESS_GC
+    minor = major = true;
+#endif
+    bool begin = false;
+    if (major && !vm->gc_marking) {
+        if (vm->gc_thread)
+            start_collector();
+        begin = vm->gc_thread || vm->gc_slice > 0;
+    }
+
+    lock_heap();
+    /* a major collection marks what's reachable as it begins and leaves
+     * younger objects alone, so there mustn't be any */
+    if (minor || begin)
+        collect_nursery();
+    if (begin) {
+        finish_sweeping();
+#ifdef DEBUG_LOG_GC
+        printf("-- gc begin marking\n");
+#endif
+        vm->gc_marking = true;
+        vm->gc_stats.major_count++;
+        mark_roots();
+        if (vm->gc_thread) {
+            vm->next_gc = vm->gc_limit;
+            pthread_cond_signal(&vm->collector_wake);
+        } else {
+            mark_slice();
+        }
+    } else if (vm->gc_marking) {
+        if (!vm->gc_thread)
+            mark_slice();
+        else if (vm->gray_count == 0)
+            garbage_collect();
+    }
+    unlock_heap();
+    record_pause(start);
+}
+
+/* the pause at rank nearest fraction of the way through, rounded up to
+ * the end of its bucket */
+static uint64_t
+percentile(gc_stats_t *stats, double fraction)
+{
+    long rank = (long)(fraction * (double)stats->pause_count + 0.999999);
+    long seen = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        seen += stats->pauses[i];
+        if (seen >= rank)
+            return bucket_limit(i) < stats->max_ns ? bucket_limit(i)
+                                                    : stats->max_ns;
+    }
+    return stats->max_ns;
+}
+
+void
+fprint_gc_stats(FILE *file, gc_stats_t *stats)
+{
+    fprintf(file,
+            "gc: %ld pauses, %ld minor and %ld major collections (%ld "
+            "compacting), %.3f ms\n",
+            stats->pause_count,
+            stats->minor_count,
+            stats->major_count,
+            stats->compact_count,
+            (double)stats->total_ns / 1e6);
+    if (stats->pause_count == 0)
+        return;
+    fprintf(file,
+            "gc: pause p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            (double)percentile(stats, 0.5) / 1e3,
+            (double)percentile(stats, 0.99) / 1e3,
+            (double)stats->max_ns / 1e3);
+}
+
 void
 free_objects(void)
 {
-    obj_t *object = vm.objects;
-    while (object != NULL) {
-        obj_t *next = object->next;
-        object_free(object);
-        object = next;
+    stop_collector();
+    for (int i = 0; i < vm->page_count; i++) {
+        page_t *page = vm->pages[i];
+        for (int j = 0; j < page->slot_count; j++)
+            if (page->allocated[j / 64] & (uint64_t)1 << (j % 64))
+                object_free(page_slot(page, j));
+        munmap(page, SLAB_PAGE_SIZE);
+    }
+    while (vm->page_pool != NULL) {
+        page_t *page = vm->page_pool;
+        vm->page_pool = page->next;
+        munmap(page, SLAB_PAGE_SIZE);
     }
-    free(vm.gray_stack);
+    free(vm->pages);
+    for (obj_t *young = (obj_t *)vm->nursery; (char *)young < vm->nursery_top;
+         young = next_young(young))
+        free_contents(young);
+    free(vm->nursery);
+    free(vm->nursery_marks);
+    free(vm->remembered);
+    free(vm->gray_stack);
 }
@@ -2,8 +2,43 @@
 #define clox_memory_h
 
 #include <stddef.h>
+#include <stdio.h>
 
+#include "object.h"
 #include "value.h"
+#include "vm.h"
+
+/* young objects are bump allocated here and copied out by collect_nursery()
+ * if they survive */
+#define NURSERY_SIZE (512 * 1024)
+
+/* how many objects a slice of an incremental major collection marks, 0
+ * marks the whole heap in one pause. each VM starts with this and can be
+ * changed after vm_init */
+#ifndef GC_SLICE
+#define GC_SLICE 1000
+#endif
+
+/* whether each VM starts out marking on a collector thread of its own */
+#ifndef GC_THREAD
+#define GC_THREAD 0
+#endif
+
+/* how many threads each VM starts out collecting with, 0 for one per core.
+ * only heaps of at least GC_PARALLEL_BYTES are worth more than one */
+#ifndef GC_WORKERS
+#define GC_WORKERS 0
+#endif
+#ifndef GC_PARALLEL_BYTES
+#define GC_PARALLEL_BYTES (4 * 1024 * 1024)
+#endif
+
+/* a major collection that finds this percentage of the old generation's
+ * pages could be given back has it compacted, 0 leaves that to compact().
+ * each VM starts with this and can be changed after vm_init */
+#ifndef GC_COMPACT
+#define GC_COMPACT 0
+#endif
 
 #define ALLOCATE(type, count)                                                 \
     (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -25,13 +60,84 @@ grow_capacity(int old_capacity)
 
 void *
 reallocate(void *pointer, size_t old_size, size_t new_size);
+void *
+nursery_allocate(size_t size);
+void *
+slab_allocate(size_t size);
+bool
+is_marked(obj_t *object);
 void
 mark_object(obj_t *object);
 void
 mark_value(value_t value);
+obj_t *
+forward_object(obj_t *object);
+void
+forward_value(value_t *value);
+void
+remember(obj_t *object);
+void
+shade(value_t value);
+void
+lock_heap(void);
+void
+unlock_heap(void);
+
+/* call after storing value into object. an old object that points into
+ * the nursery has to be scanned by the next minor collection */
+static inline void
+write_barrier(obj_t *object, value_t value)
+{
+    if (is_obj(value) && object->is_old && !object->is_remembered &&
+        !as_obj(value)->is_old)
+        remember(object);
+}
+
+/* a major collection marks what was reachable when it began, anything
+ * newer is left alone. stores into an old object while it's marking go
+ * between begin_write and end_write, and what they overwrite has to be
+ * passed to shade first. a collector thread only looks at the object
+ * before or after */
+static inline bool
+begin_write(obj_t *object)
+{
+    if (!object->is_old || !vm->gc_marking)
+        return false;
+    lock_heap();
+    return true;
+}
+
+static inline void
+end_write(bool marking)
+{
+    if (marking)
+        unlock_heap();
+}
+
+void
+write_old_field(obj_t *object, value_t *field, value_t value);
+
+static inline void
+write_field(obj_t *object, value_t *field, value_t value)
+{
+    if (object->is_old)
+        write_old_field(object, field, value);
+    else
+        *field = value;
+}
+
+bool
+write_entry(obj_t *object, table_t *table, obj_string *key, value_t value);
+
 void
 garbage_collect(void);
 void
+collect_nursery(void);
+void
+collect_at_safepoint(void);
+void
+fprint_gc_stats(FILE *file, gc_stats_t *stats);
+void
 free_objects(void);
 
 #endif /* clox_memory_h */
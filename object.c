@@ -12,17 +12,24 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type)                                       \
-    (type *)object_allocate(sizeof(type), object_type)
-
-static obj_t *
+obj_t *
 object_allocate(size_t size, obj_type_t type)
 {
-    obj_t *object = (obj_t *)reallocate(NULL, 0, size);
+    obj_t *object = (obj_t *)nursery_allocate(size);
+    if (object != NULL) {
+        object->is_old = false;
+        object->next = NULL;
+    } else {
+        /* no room left until the next minor collection. it starts out old,
+         * and remembered since it's about to be filled in with young
+         * pointers */
+        object = (obj_t *)slab_allocate(size);
+        object->is_old = true;
+        object->next = NULL;
+    }
     object->type = type;
-    object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->is_remembered = false;
+    remember(object);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -46,6 +53,9 @@ newclass(obj_string *name)
     obj_class *class = ALLOCATE_OBJ(obj_class, OBJ_CLASS);
     class->name = name;
     table_init(&class->methods);
+    class->version = 0;
+    class->root_shape = NULL;
+    class->field_hint = 0;
     return class;
 }
 
@@ -68,6 +78,7 @@ newfunction(void)
     obj_function *function = ALLOCATE_OBJ(obj_function, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->max_slots = 0;
     function->name = NULL;
     init_chunk(&function->chunk);
     return function;
@@ -76,9 +87,20 @@ newfunction(void)
 obj_instance *
 newinstance(obj_class *class)
 {
+    if (class->root_shape == NULL) {
+        obj_shape *shape = newshape(NULL, NULL);
+        bool marking = begin_write(&class->obj);
+        class->root_shape = shape;
+        end_write(marking);
+        write_barrier(&class->obj, obj_val((obj_t *)shape));
+    }
+    value_t *fields = ALLOCATE(value_t, class->field_hint);
     obj_instance *instance = ALLOCATE_OBJ(obj_instance, OBJ_INSTANCE);
     instance->class = class;
-    table_init(&instance->fields);
+    instance->shape = class->root_shape;
+    instance->field_capacity = class->field_hint;
+    instance->fields = fields;
+    instance->dictionary = NULL;
     return instance;
 }
 
@@ -90,6 +112,122 @@ newnative(native_fn function)
     return native;
 }
 
+obj_shape *
+newshape(obj_shape *parent, obj_string *key)
+{
+    obj_shape *shape = ALLOCATE_OBJ(obj_shape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->key = key;
+    shape->slot_count = parent != NULL ? parent->slot_count + 1 : 0;
+    table_init(&shape->transitions);
+    return shape;
+}
+
+obj_shape *
+shape_transition(obj_shape *shape, obj_string *key)
+{
+    value_t next;
+    if (table_get(&shape->transitions, key, &next))
+        return (obj_shape *)as_obj(next);
+
+    obj_shape *child = newshape(shape, key);
+    push(obj_val((obj_t *)child));
+    write_entry(
+      &shape->obj, &shape->transitions, key, obj_val((obj_t *)child));
+    pop();
+    return child;
+}
+
+int
+shape_find_slot(obj_shape *shape, obj_string *key)
+{
+    for (; shape->key != NULL; shape = shape->parent)
+        if (shape->key == key)
+            return shape->slot_count - 1;
+    return -1;
+}
+
+bool
+instance_get_field(obj_instance *instance, obj_string *key, value_t *value)
+{
+    if (instance->shape == NULL)
+        return table_get(instance->dictionary, key, value);
+
+    int slot = shape_find_slot(instance->shape, key);
+    if (slot == -1)
+        return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+static void
+instance_add_field(obj_instance *instance, obj_string *key, value_t value)
+{
+    /* the new shape is reachable through the old one's transitions */
+    obj_shape *next = shape_transition(instance->shape, key);
+    int slot = instance->shape->slot_count;
+    bool marking = begin_write(&instance->obj);
+    if (marking)
+        shade(obj_val((obj_t *)instance->shape));
+    if (slot >= instance->field_capacity) {
+        int old_capacity = instance->field_capacity;
+        instance->field_capacity = old_capacity < 4 ? 4 : old_capacity * 2;
+        instance->fields = GROW_ARRAY(
+          value_t, instance->fields, old_capacity, instance->field_capacity);
+    }
+    instance->fields[slot] = value;
+    instance->shape = next;
+    end_write(marking);
+    write_barrier(&instance->obj, value);
+    write_barrier(&instance->obj, obj_val((obj_t *)next));
+    if (next->slot_count > instance->class->field_hint)
+        instance->class->field_hint = next->slot_count;
+}
+
+static void
+instance_make_dictionary(obj_instance *instance)
+{
+    /* until the swap below the keys and values are still reachable through
+     * the shape and the field array */
+    table_t *dictionary = ALLOCATE(table_t, 1);
+    table_init(dictionary);
+    for (obj_shape *shape = instance->shape; shape->key != NULL;
+         shape = shape->parent)
+        table_set(
+          dictionary, shape->key, instance->fields[shape->slot_count - 1]);
+
+    value_t *fields = instance->fields;
+    int field_capacity = instance->field_capacity;
+    bool marking = begin_write(&instance->obj);
+    if (marking)
+        shade(obj_val((obj_t *)instance->shape));
+    instance->fields = NULL;
+    instance->field_capacity = 0;
+    instance->shape = NULL;
+    instance->dictionary = dictionary;
+    end_write(marking);
+    remember(&instance->obj);
+    FREE_ARRAY(value_t, fields, field_capacity);
+}
+
+void
+instance_set_field(obj_instance *instance, obj_string *key, value_t value)
+{
+    if (instance->shape != NULL) {
+        int slot = shape_find_slot(instance->shape, key);
+        if (slot != -1) {
+            write_field(&instance->obj, &instance->fields[slot], value);
+            return;
+        }
+        if (instance->shape->slot_count < SHAPE_MAX_FIELDS) {
+            instance_add_field(instance, key, value);
+            return;
+        }
+        instance_make_dictionary(instance);
+    }
+    write_entry(&instance->obj, instance->dictionary, key, value);
+}
+
 static obj_string *
 allocate_string(char *chars, int length, uint32_t hash)
 {
@@ -98,7 +236,7 @@ allocate_string(char *chars, int length, uint32_t hash)
     string->chars = chars;
     string->hash = hash;
     push(obj_val((obj_t *)string));
-    table_set(&vm.strings, string, nil_val());
+    table_set(&vm->strings, string, nil_val());
     pop();
     return string;
 }
@@ -114,11 +252,26 @@ hash_string(const char *key, int length)
     return hash;
 }
 
+/* interned strings are weak, so one a major collection that's marking
+ * hasn't reached may have been unreachable since it began. finding it
+ * makes it reachable again */
+static obj_string *
+find_interned(const char *chars, int length, uint32_t hash)
+{
+    obj_string *interned = table_find_string(&vm->strings, chars, length, hash);
+    if (interned != NULL && vm->gc_marking) {
+        lock_heap();
+        shade(obj_val((obj_t *)interned));
+        unlock_heap();
+    }
+    return interned;
+}
+
 obj_string *
 take_string(char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    obj_string *interned = table_find_string(&vm.strings, chars, length, hash);
+    obj_string *interned = find_interned(chars, length, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
         return interned;
@@ -130,7 +283,7 @@ obj_string *
 copy_string(const char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
-    obj_string *interned = table_find_string(&vm.strings, chars, length, hash);
+    obj_string *interned = find_interned(chars, length, hash);
     if (interned != NULL)
         return interned;
     char *heap_chars = ALLOCATE(char, length + 1);
@@ -151,42 +304,46 @@ newupvalue(value_t *slot)
 }
 
 static void
-print_function(obj_function *function)
+print_function(FILE *file, obj_function *function)
 {
     if (function->name == NULL) {
-        printf("<script>");
+        fprintf(file, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(file, "<fn %s>", function->name->chars);
 }
 
 void
-print_object(value_t value)
+fprint_object(FILE *file, value_t value)
 {
     switch (obj_type(value)) {
         case OBJ_BOUND_METHOD:
-            print_function(as_bound_method(value)->method->function);
+            print_function(file, as_bound_method(value)->method->function);
             break;
         case OBJ_CLASS:
-            printf("%s", as_class(value)->name->chars);
+            fprintf(file, "%s", as_class(value)->name->chars);
             break;
         case OBJ_CLOSURE:
-            print_function(as_closure(value)->function);
+            print_function(file, as_closure(value)->function);
             break;
         case OBJ_FUNCTION:
-            print_function(as_function(value));
+            print_function(file, as_function(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", as_instance(value)->class->name->chars);
+            fprintf(
+              file, "%s instance", as_instance(value)->class->name->chars);
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            fprintf(file, "<native fn>");
+            break;
+        case OBJ_SHAPE:
+            fprintf(file, "shape");
             break;
         case OBJ_STRING:
-            printf("%s", as_cstring(value));
+            fprintf(file, "%s", as_cstring(value));
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            fprintf(file, "upvalue");
             break;
     }
 }
@@ -2,7 +2,9 @@
 #define clox_object_h
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "chunk.h"
 #include "table.h"
@@ -16,6 +18,7 @@ typedef enum
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } obj_type_t;
@@ -23,7 +26,11 @@ typedef enum
 struct obj_t
 {
     obj_type_t type;
-    bool is_marked;
+    /* outside the nursery, and if so whether it's in the remembered set */
+    bool is_old;
+    bool is_remembered;
+    /* free slots in the old generation are linked through next, a young
+     * object copied out of the nursery leaves its new address here */
     struct obj_t *next;
 };
 
@@ -32,6 +39,7 @@ typedef struct
     obj_t obj;
     int arity;
     int upvalue_count;
+    int max_slots; /* most locals live at once, checked against the stack */
     chunk_t chunk;
     obj_string *name;
 } obj_function;
@@ -71,18 +79,44 @@ typedef struct
     int upvalue_count;
 } obj_closure;
 
-typedef struct
+/* instances with more fields than this leave their shape and keep their
+ * fields in a hash table instead */
+#define SHAPE_MAX_FIELDS 32
+
+/* a shape is the ordered set of field names an instance has, each instance
+ * that adds the same fields in the same order ends up sharing one. shapes
+ * form a tree per class rooted at the empty shape, adding a field follows
+ * (or creates) the transition for that name */
+struct obj_shape
+{
+    obj_t obj;
+    struct obj_shape *parent;
+    obj_string *key;
+    int slot_count;
+    table_t transitions;
+};
+
+struct obj_class
 {
     obj_t obj;
     obj_string *name;
     table_t methods;
-} obj_class;
+    /* bumped whenever methods changes so cached lookups can tell */
+    uint32_t version;
+    obj_shape *root_shape;
+    /* most fields any instance has had, used to size new instances */
+    int field_hint;
+};
 
 typedef struct
 {
     obj_t obj;
     obj_class *class;
-    table_t fields;
+    /* NULL once the instance has switched to dictionary mode */
+    obj_shape *shape;
+    int field_capacity;
+    value_t *fields;
+    table_t *dictionary;
 } obj_instance;
 
 typedef struct
@@ -92,6 +126,12 @@ typedef struct
     obj_closure *method;
 } obj_bound_method;
 
+#define ALLOCATE_OBJ(type, object_type)                                       \
+    (type *)object_allocate(sizeof(type), object_type)
+
+obj_t *
+object_allocate(size_t size, obj_type_t type);
+
 obj_bound_method *
 newbound_method(value_t receiver, obj_closure *method);
 
@@ -110,6 +150,18 @@ newinstance(obj_class *class);
 obj_native *
 newnative(native_fn function);
 
+obj_shape *
+newshape(obj_shape *parent, obj_string *key);
+obj_shape *
+shape_transition(obj_shape *shape, obj_string *key);
+int
+shape_find_slot(obj_shape *shape, obj_string *key);
+
+bool
+instance_get_field(obj_instance *instance, obj_string *key, value_t *value);
+void
+instance_set_field(obj_instance *instance, obj_string *key, value_t value);
+
 obj_string *
 take_string(char *chars, int length);
 obj_string *
@@ -117,7 +169,7 @@ copy_string(const char *chars, int length);
 obj_upvalue *
 newupvalue(value_t *slot);
 void
-print_object(value_t value);
+fprint_object(FILE *file, value_t value);
 
 static inline obj_type_t
 obj_type(value_t value)
@@ -0,0 +1,328 @@
+#include "peephole.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+/* an instruction of the chunk being optimized. jumps refer to their target
+ * by instruction index rather than offset so code can move under them */
+typedef struct
+{
+    int offset;
+    int length;
+    int target;
+    bool removed;
+    bool is_target;
+} instruction_t;
+
+typedef struct
+{
+    chunk_t *chunk;
+    int count;
+    instruction_t *code;
+} pass_t;
+
+/* where the 16-bit jump operand sits in an instruction, 0 for non-jumps */
+static int
+jump_operand(uint8_t op)
+{
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+            return 1;
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static bool
+is_unconditional(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+/* pushes a value and can't fail or run code doing it */
+static bool
+is_pure_push(uint8_t op)
+{
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_GET_UPVALUE_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint8_t
+op_at(pass_t *pass, int index)
+{
+    if (index == pass->count)
+        return OP_RETURN;
+    return pass->chunk->code[pass->code[index].offset];
+}
+
+/* the first instruction at or after index still in the code */
+static int
+live(pass_t *pass, int index)
+{
+    while (index < pass->count && pass->code[index].removed)
+        index++;
+    return index;
+}
+
+static void
+remove_instruction(pass_t *pass, int index)
+{
+    instruction_t *instruction = &pass->code[index];
+    instruction->removed = true;
+    if (instruction->is_target && index + 1 < pass->count)
+        pass->code[live(pass, index + 1)].is_target = true;
+}
+
+static void
+decode(pass_t *pass)
+{
+    chunk_t *chunk = pass->chunk;
+    int *index_at = ALLOCATE(int, chunk->count + 1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instruction_length(chunk, offset))
+        index_at[offset] = count++;
+    index_at[chunk->count] = count;
+
+    pass->count = count;
+    pass->code = ALLOCATE(instruction_t, count);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        instruction_t *instruction = &pass->code[i];
+        instruction->offset = offset;
+        instruction->length = instruction_length(chunk, offset);
+        instruction->target = -1;
+        instruction->removed = false;
+        instruction->is_target = false;
+
+        uint8_t op = chunk->code[offset];
+        int operand = jump_operand(op);
+        if (operand != 0) {
+            uint8_t *bytes = &chunk->code[offset + operand];
+            int jump = bytes[0] << 8 | bytes[1];
+            int next = offset + instruction->length;
+            instruction->target = index_at[op == OP_LOOP ? next - jump
+                                                         : next + jump];
+        }
+        offset += instruction->length;
+    }
+    FREE_ARRAY(int, index_at, chunk->count + 1);
+}
+
+static void
+mark_targets(pass_t *pass)
+{
+    for (int i = 0; i < pass->count; i++)
+        pass->code[i].is_target = false;
+    for (int i = 0; i < pass->count; i++) {
+        instruction_t *instruction = &pass->code[i];
+        if (!instruction->removed && instruction->target != -1) {
+            instruction->target = live(pass, instruction->target);
+            if (instruction->target < pass->count)
+                pass->code[instruction->target].is_target = true;
+        }
+    }
+}
+
+/* whether a jump from the instruction at index to target fits the operand,
+ * measured on the uncompacted code so it can only get shorter */
+static bool
+in_range(pass_t *pass, int index, int target)
+{
+    instruction_t *from = &pass->code[index];
+    int to = target < pass->count
+               ? pass->code[target].offset
+               : pass->chunk->count;
+    return abs(to - (from->offset + from->length)) <= UINT16_MAX;
+}
+
+/* follows a chain of unconditional jumps from the target of the jump at
+ * index. a conditional jump can only go forward so it stops short of any
+ * hop that would take it back */
+static bool
+thread_jump(pass_t *pass, int index)
+{
+    bool conditional = !is_unconditional(op_at(pass, index));
+    int target = pass->code[index].target;
+    for (int hops = 0; hops < pass->count; hops++) {
+        if (target == index || !is_unconditional(op_at(pass, target)))
+            break;
+        int next = live(pass, pass->code[target].target);
+        if (next == target || (conditional && next <= index) ||
+            !in_range(pass, index, next))
+            break;
+        target = next;
+    }
+    if (target == pass->code[index].target)
+        return false;
+    pass->code[index].target = target;
+    return true;
+}
+
+static bool
+rewrite(pass_t *pass, int index)
+{
+    instruction_t *instruction = &pass->code[index];
+    uint8_t op = op_at(pass, index);
+    int next = live(pass, index + 1);
+    bool changed = false;
+
+    if (instruction->target != -1) {
+        instruction->target = live(pass, instruction->target);
+        changed = thread_jump(pass, index);
+    }
+
+    switch (op) {
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            /* a jump to the next instruction does nothing either way */
+            if (instruction->target == next) {
+                remove_instruction(pass, index);
+                return true;
+            }
+            break;
+        case OP_NOT: {
+            /* NOT, JUMP_IF_FALSE -> JUMP_IF_TRUE, when the condition left
+             * on the stack is popped straight away on both edges */
+            uint8_t jump = op_at(pass, next);
+            if ((jump != OP_JUMP_IF_FALSE && jump != OP_JUMP_IF_TRUE) ||
+                pass->code[next].is_target ||
+                op_at(pass, live(pass, next + 1)) != OP_POP ||
+                op_at(pass, pass->code[next].target) != OP_POP)
+                break;
+            pass->chunk->code[pass->code[next].offset] =
+              jump == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+            remove_instruction(pass, index);
+            return true;
+        }
+        default:
+            if (is_pure_push(op) && op_at(pass, next) == OP_POP &&
+                !pass->code[next].is_target) {
+                remove_instruction(pass, index);
+                remove_instruction(pass, next);
+                return true;
+            }
+            break;
+    }
+
+    /* nothing falls through into the code after a return or a jump, so up to
+     * the next jump target it can't be reached */
+    if (op == OP_RETURN || is_unconditional(op)) {
+        for (int i = next; i < pass->count && !pass->code[i].is_target; i++) {
+            if (!pass->code[i].removed) {
+                pass->code[i].removed = true;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+/* moves the surviving instructions down over the removed ones and points
+ * every jump at where its target ended up */
+static void
+compact(pass_t *pass)
+{
+    chunk_t *chunk = pass->chunk;
+    int *new_offset = ALLOCATE(int, pass->count + 1);
+    int count = 0;
+    for (int i = 0; i < pass->count; i++) {
+        new_offset[i] = count;
+        if (!pass->code[i].removed)
+            count += pass->code[i].length;
+    }
+    new_offset[pass->count] = count;
+
+    /* the line of every byte that stays, before the runs are rebuilt */
+    int *lines = ALLOCATE(int, count);
+    for (int i = 0; i < pass->count; i++) {
+        instruction_t *instruction = &pass->code[i];
+        if (instruction->removed)
+            continue;
+        for (int j = 0; j < instruction->length; j++)
+            lines[new_offset[i] + j] = get_line(chunk, instruction->offset + j);
+    }
+
+    chunk->line_count = 0;
+    for (int i = 0; i < pass->count; i++) {
+        instruction_t *instruction = &pass->code[i];
+        if (instruction->removed)
+            continue;
+        int from = instruction->offset;
+        int to = new_offset[i];
+        memmove(&chunk->code[to], &chunk->code[from], instruction->length);
+        for (int j = 0; j < instruction->length; j++)
+            add_line(chunk, to + j, lines[to + j]);
+    }
+    FREE_ARRAY(int, lines, count);
+
+    for (int i = 0; i < pass->count; i++) {
+        instruction_t *instruction = &pass->code[i];
+        if (instruction->removed || instruction->target == -1)
+            continue;
+        uint8_t *code = &chunk->code[new_offset[i]];
+        int next = new_offset[i] + instruction->length;
+        int target = new_offset[instruction->target];
+        int jump = target - next;
+        if (is_unconditional(code[0])) {
+            code[0] = instruction->target > i ? OP_JUMP : OP_LOOP;
+            if (code[0] == OP_LOOP)
+                jump = -jump;
+        }
+        int operand = jump_operand(code[0]);
+        code[operand] = (jump >> 8) & 0xff;
+        code[operand + 1] = jump & 0xff;
+    }
+
+    chunk->count = count;
+    FREE_ARRAY(int, new_offset, pass->count + 1);
+}
+
+/* rewrites a finished chunk in place: threads jumps through jumps, turns
+ * NOT, JUMP_IF_FALSE into JUMP_IF_TRUE, drops pushes that are popped right
+ * away and code nothing can reach. returns the number of bytes saved */
+int
+optimize_chunk(chunk_t *chunk)
+{
+    pass_t pass;
+    pass.chunk = chunk;
+    decode(&pass);
+
+    bool changed;
+    do {
+        changed = false;
+        mark_targets(&pass);
+        for (int i = 0; i < pass.count; i++) {
+            if (!pass.code[i].removed && rewrite(&pass, i))
+                changed = true;
+        }
+    } while (changed);
+
+    int before = chunk->count;
+    compact(&pass);
+    FREE_ARRAY(instruction_t, pass.code, pass.count);
+    return before - chunk->count;
+}
@@ -0,0 +1,9 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+int
+optimize_chunk(chunk_t *);
+
+#endif /* clox_peephole_h */
@@ -0,0 +1,185 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* the jobs a worker has yet to start. the worker takes from the back and
+ * the others steal from the front once their own are gone */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int front;
+    int back;
+    int *jobs;
+} deque_t;
+
+typedef struct pool_t pool_t;
+
+/* a thread with a VM of its own that every job it runs starts fresh in */
+typedef struct
+{
+    pool_t *pool;
+    int index;
+    pthread_t thread;
+    vm_t *vm;
+    deque_t queue;
+} worker_t;
+
+struct pool_t
+{
+    job_t *jobs;
+    int worker_count;
+    worker_t *workers;
+};
+
+static void *
+allocate(size_t size)
+{
+    void *memory = malloc(size);
+    if (memory == NULL) {
+        fprintf(stderr, "Not enough memory for the job pool.\n");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static bool
+take_back(deque_t *queue, int *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool taken = queue->back > queue->front;
+    if (taken)
+        *job = queue->jobs[--queue->back];
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+static bool
+steal_front(deque_t *queue, int *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool taken = queue->back > queue->front;
+    if (taken)
+        *job = queue->jobs[queue->front++];
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+/* the next job for worker, false once every queue is empty. no job is
+ * queued after the workers start so an empty pass means they're done */
+static bool
+next_job(worker_t *worker, int *job)
+{
+    if (take_back(&worker->queue, job))
+        return true;
+    pool_t *pool = worker->pool;
+    for (int i = 1; i < pool->worker_count; i++) {
+        worker_t *victim = &pool->workers[(worker->index + i) %
+                                          pool->worker_count];
+        if (steal_front(&victim->queue, job))
+            return true;
+    }
+    return false;
+}
+
+static void
+run_job(vm_t *context, job_t *job)
+{
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    FILE *err = open_memstream(&job->errors, &job->errors_size);
+    if (out == NULL || err == NULL) {
+        fprintf(stderr, "Could not capture the output of \"%s\".\n",
+                job->path);
+        exit(EXIT_FAILURE);
+    }
+
+    vm_init(context);
+    /* the pool keeps every core busy already, so it collects alone */
+    context->gc_workers = 1;
+    context->out = out;
+    context->err = err;
+    job->result = interpret_file(context, job->path);
+    free_vm(context);
+
+    fclose(out);
+    fclose(err);
+}
+
+static void *
+work(void *argument)
+{
+    worker_t *worker = (worker_t *)argument;
+    int job;
+    while (next_job(worker, &job))
+        run_job(worker->vm, &worker->pool->jobs[job]);
+    return NULL;
+}
+
+/* runs every job on a pool of thread_count threads, each with its own
+ * VM, and returns once they have all finished. a job only sees the
+ * globals its own script defines */
+void
+run_jobs(job_t *jobs, int count, int thread_count)
+{
+    for (int i = 0; i < count; i++) {
+        jobs[i].output = NULL;
+        jobs[i].output_size = 0;
+        jobs[i].errors = NULL;
+        jobs[i].errors_size = 0;
+    }
+    if (thread_count > count)
+        thread_count = count;
+    if (thread_count < 1)
+        return;
+
+    pool_t pool;
+    pool.jobs = jobs;
+    pool.worker_count = thread_count;
+    pool.workers = (worker_t *)allocate(sizeof(worker_t) * thread_count);
+
+    /* deal the jobs out in turn so every worker starts with a share */
+    for (int i = 0; i < thread_count; i++) {
+        worker_t *worker = &pool.workers[i];
+        worker->pool = &pool;
+        worker->index = i;
+        worker->vm = (vm_t *)allocate(sizeof(vm_t));
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        worker->queue.front = 0;
+        worker->queue.back = 0;
+        worker->queue.jobs =
+          (int *)allocate(sizeof(int) * (count / thread_count + 1));
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        deque_t *queue = &pool.workers[i % thread_count].queue;
+        queue->jobs[queue->back++] = i;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(
+              &pool.workers[i].thread, NULL, work, &pool.workers[i]) != 0) {
+            fprintf(stderr, "Could not start a worker thread.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+
+    for (int i = 0; i < thread_count; i++) {
+        worker_t *worker = &pool.workers[i];
+        pthread_mutex_destroy(&worker->queue.lock);
+        free(worker->queue.jobs);
+        free(worker->vm);
+    }
+    free(pool.workers);
+}
+
+void
+free_job(job_t *job)
+{
+    free(job->output);
+    free(job->errors);
+    job->output = NULL;
+    job->errors = NULL;
+}
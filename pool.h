@@ -0,0 +1,25 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include <stddef.h>
+
+#include "vm.h"
+
+/* a script for run_jobs and, once it has run, what it printed and how it
+ * ended */
+typedef struct
+{
+    const char *path;
+    interpret_result result;
+    char *output;
+    size_t output_size;
+    char *errors;
+    size_t errors_size;
+} job_t;
+
+void
+run_jobs(job_t *jobs, int count, int thread_count);
+void
+free_job(job_t *job);
+
+#endif /* clox_pool_h */
@@ -12,7 +12,7 @@ typedef struct
     int line;
 } scanner_t;
 
-static scanner_t scanner;
+static _Thread_local scanner_t scanner;
 
 void
 init_scanner(const char *source)
@@ -118,6 +118,19 @@ table_delete(table_t *table, obj_string *key)
     return true;
 }
 
+/* puts new_key in the place of key, which must hash the same. used when an
+ * object moves so it can't allocate */
+void
+table_rekey(table_t *table, obj_string *key, obj_string *new_key)
+{
+    if (table->count == 0)
+        return;
+
+    entry_t *entry = find_entry(table->entries, table->capacity, key);
+    if (entry->key == key)
+        entry->key = new_key;
+}
+
 void
 table_add_all(table_t *from, table_t *to)
 {
@@ -155,7 +168,9 @@ table_remove_white(table_t *table)
 {
     for (int i = 0; i < table->capacity; i++) {
         entry_t *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked)
+        /* young keys are left to the minor collections */
+        if (entry->key != NULL && entry->key->obj.is_old &&
+            !is_marked(&entry->key->obj))
             table_delete(table, entry->key);
     }
 }
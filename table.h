@@ -29,6 +29,8 @@ table_set(table_t *table, obj_string *key, value_t value);
 bool
 table_delete(table_t *table, obj_string *key);
 void
+table_rekey(table_t *table, obj_string *key, obj_string *new_key);
+void
 table_add_all(table_t *from, table_t *to);
 obj_string *
 table_find_string(table_t *table,
@@ -36,35 +36,46 @@ free_value_array(value_array *array)
 }
 
 void
-print_value(value_t value)
+fprint_value(FILE *file, value_t value)
 {
 #ifdef NAN_BOXING
     if (is_bool(value))
-        printf(as_bool(value) ? "true" : "false");
+        fprintf(file, as_bool(value) ? "true" : "false");
     else if (is_nil(value))
-        printf("nil");
+        fprintf(file, "nil");
     else if (is_number(value))
-        printf("%g", as_number(value));
+        fprintf(file, "%g", as_number(value));
     else if (is_obj(value))
-        print_object(value);
+        fprint_object(file, value);
+    else if (is_undefined(value))
+        fprintf(file, "undefined");
 #else  /* NAN_BOXING */
     switch (value.type) {
         case VAL_BOOL:
-            printf(as_bool(value) ? "true" : "false");
+            fprintf(file, as_bool(value) ? "true" : "false");
             break;
         case VAL_NIL:
-            printf("nil");
+            fprintf(file, "nil");
             break;
         case VAL_NUMBER:
-            printf("%g", as_number(value));
+            fprintf(file, "%g", as_number(value));
             break;
         case VAL_OBJ:
-            print_object(value);
+            fprint_object(file, value);
+            break;
+        case VAL_UNDEFINED:
+            fprintf(file, "undefined");
             break;
     }
 #endif /* NAN_BOXING */
 }
 
+void
+print_value(value_t value)
+{
+    fprint_value(stdout, value);
+}
+
 bool
 values_equal(value_t a, value_t b)
 {
@@ -79,6 +90,7 @@ values_equal(value_t a, value_t b)
         case VAL_BOOL:
             return as_bool(a) == as_bool(b);
         case VAL_NIL:
+        case VAL_UNDEFINED:
             return true;
         case VAL_NUMBER:
             return as_number(a) == as_number(b);
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 typedef struct obj_t obj_t;
@@ -16,6 +17,7 @@ typedef struct obj_string obj_string;
 #define TAG_NIL ((uint64_t)1)
 #define TAG_FALSE ((uint64_t)2)
 #define TAG_TRUE ((uint64_t)3)
+#define TAG_UNDEFINED ((uint64_t)4)
 
 typedef uint64_t value_t;
 
@@ -38,6 +40,12 @@ is_nil(value_t value)
     return value == nil_val();
 }
 
+static inline bool
+is_undefined(value_t value)
+{
+    return value == (QNAN | TAG_UNDEFINED);
+}
+
 static inline bool
 is_number(value_t value)
 {
@@ -94,6 +102,12 @@ nil_val(void)
     return QNAN | TAG_NIL;
 }
 
+static inline value_t
+undefined_val(void)
+{
+    return QNAN | TAG_UNDEFINED;
+}
+
 static inline value_t
 number_val(double num)
 {
@@ -116,6 +130,7 @@ typedef enum
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED, /* never seen by lox code, marks an unset global */
 } value_type;
 
 typedef struct
@@ -141,6 +156,12 @@ is_nil(value_t value)
     return value.type == VAL_NIL;
 }
 
+static inline bool
+is_undefined(value_t value)
+{
+    return value.type == VAL_UNDEFINED;
+}
+
 static inline bool
 is_number(value_t value)
 {
@@ -183,6 +204,12 @@ nil_val(void)
     return (value_t){ VAL_NIL, { .number = 0 } };
 }
 
+static inline value_t
+undefined_val(void)
+{
+    return (value_t){ VAL_UNDEFINED, { .number = 0 } };
+}
+
 static inline value_t
 number_val(double value)
 {
@@ -213,6 +240,7 @@ write_value_array(value_array *, value_t);
 void
 free_value_array(value_array *);
 
+void fprint_value(FILE *, value_t);
 void print_value(value_t);
 
 #endif /* clox_value_h */
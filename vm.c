@@ -4,12 +4,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "bytecode.h"
 #include "chunk.h"
 #include "compiler.h"
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_OPCODE_STATS)
 #include "debug.h"
 #endif
 #include "memory.h"
@@ -17,7 +20,11 @@
 #include "table.h"
 #include "value.h"
 
-vm_t vm;
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+_Thread_local vm_t *vm = NULL;
 
 static value_t
 native_clock(int arg_count, value_t *args)
@@ -25,12 +32,50 @@ native_clock(int arg_count, value_t *args)
     return number_val((double)clock() / CLOCKS_PER_SEC);
 }
 
+/* compacts the heap at the next safepoint */
+static value_t
+native_compact(int arg_count, value_t *args)
+{
+    vm->compact_pending = true;
+    vm->gc_pending = true;
+    return nil_val();
+}
+
+/* the natives every VM starts with, images refer to them by name */
+static const struct
+{
+    const char *name;
+    native_fn function;
+} natives[] = {
+    { "clock", native_clock },
+    { "compact", native_compact },
+};
+
+const char *
+native_name(native_fn function)
+{
+    for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++)
+        if (natives[i].function == function)
+            return natives[i].name;
+    return NULL;
+}
+
+native_fn
+find_native(const char *name, int length)
+{
+    for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++)
+        if ((int)strlen(natives[i].name) == length &&
+            memcmp(natives[i].name, name, (size_t)length) == 0)
+            return natives[i].function;
+    return NULL;
+}
+
 static void
 reset_stack(void)
 {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = NULL;
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalues = NULL;
 }
 
 static void
@@ -38,19 +83,20 @@ runtime_error(const char *format, ...)
 {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--) {
-        call_frame_t *frame = &vm.frames[i];
+    for (int i = vm->frame_count - 1; i >= 0; i--) {
+        call_frame_t *frame = &vm->frames[i];
         obj_function *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(
+          vm->err, "[line %d] in ", get_line(&function->chunk, instruction));
         if (function->name == NULL)
-            fprintf(stderr, "script\n");
+            fprintf(vm->err, "script\n");
         else
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(vm->err, "%s()\n", function->name->chars);
     }
 
     reset_stack();
@@ -59,63 +105,169 @@ runtime_error(const char *format, ...)
 static void
 define_native(const char *name, native_fn function)
 {
-    push(obj_val((obj_t *)copy_string(name, (int)strlen(name))));
+    int index = global_index(copy_string(name, (int)strlen(name)));
     push(obj_val((obj_t *)newnative(function)));
-    table_set(&vm.globals, as_string(vm.stack[0]), vm.stack[1]);
+    vm->globals.values[index] = vm->stack[0];
     pop();
+}
+
+/* the index of the global called name, a new undefined one is added the
+ * first time a name is seen */
+int
+global_index(obj_string *name)
+{
+    value_t index;
+    if (table_get(&vm->global_slots, name, &index))
+        return (int)as_number(index);
+
+    push(obj_val((obj_t *)name));
+    write_value_array(&vm->global_names, obj_val((obj_t *)name));
+    write_value_array(&vm->globals, undefined_val());
+    table_set(&vm->global_slots, name, number_val(vm->globals.count - 1));
     pop();
+    return vm->globals.count - 1;
 }
 
 void
-vm_init(void)
+vm_init(vm_t *context)
 {
+    vm_t *caller = vm;
+    vm = context;
     reset_stack();
-    vm.objects = NULL;
-    vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
+    vm->pages = NULL;
+    vm->page_count = 0;
+    vm->page_capacity = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        vm->free_slots[i] = NULL;
+        vm->unswept[i] = NULL;
+    }
+    vm->page_pool = NULL;
+    vm->bytes_allocated = 0;
+    vm->next_gc = 1024 * 1024;
+
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = 0;
+
+    vm->nursery = (char *)malloc(NURSERY_SIZE);
+    vm->nursery_marks =
+      (uint64_t *)calloc(NURSERY_SIZE / 8 / 64, sizeof(uint64_t));
+    if (vm->nursery == NULL || vm->nursery_marks == NULL) {
+        fprintf(stderr, "Not enough memory for a VM.\n");
+        exit(EXIT_FAILURE);
+    }
+    vm->nursery_top = vm->nursery;
+    vm->nursery_end = vm->nursery + NURSERY_SIZE;
+    vm->nursery_limit = vm->nursery_end;
+    vm->nursery_full = false;
+    vm->remembered_count = 0;
+    vm->remembered_capacity = 0;
+    vm->remembered = NULL;
+
+    vm->gc_marking = false;
+    vm->gc_slice = GC_SLICE;
+    vm->gc_limit = vm->next_gc + vm->next_gc / 2;
+    vm->gc_thread = GC_THREAD;
+    vm->collector_running = false;
+    vm->collector_stop = false;
+    vm->collector_yielded = false;
+    vm->gc_lock_depth = 0;
+    vm->gc_lock_wanted = false;
+    vm->gc_pending = false;
+    memset(&vm->gc_stats, 0, sizeof(vm->gc_stats));
+    vm->gc_workers = GC_WORKERS;
+    if (vm->gc_workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        vm->gc_workers = cores > 0 ? (int)cores : 1;
+    }
+    vm->gc_compact = GC_COMPACT;
+    vm->compact_pending = false;
+
+    vm->mapping_count = 0;
+    vm->mapping_capacity = 0;
+    vm->mappings = NULL;
+
+    vm->out = stdout;
+    vm->err = stderr;
 
-    vm.gray_count = 0;
-    vm.gray_capacity = 0;
-    vm.gray_stack = 0;
+    table_init(&vm->global_slots);
+    init_value_array(&vm->global_names);
+    init_value_array(&vm->globals);
+    table_init(&vm->strings);
 
-    table_init(&vm.globals);
-    table_init(&vm.strings);
+    vm->init_string = NULL;
+    vm->init_string = copy_string("init", 4);
 
-    vm.init_string = NULL;
-    vm.init_string = copy_string("init", 4);
+    for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++)
+        define_native(natives[i].name, natives[i].function);
 
-    define_native("clock", native_clock);
+#ifdef DEBUG_OPCODE_STATS
+    vm->opcode_stats = new_opcode_stats();
+#endif
+    vm = caller;
 }
 
 void
-free_vm(void)
+free_vm(vm_t *context)
 {
-    table_free(&vm.globals);
-    table_free(&vm.strings);
-    vm.init_string = NULL;
+    vm_t *caller = vm;
+    vm = context;
+    table_free(&vm->global_slots);
+    free_value_array(&vm->global_names);
+    free_value_array(&vm->globals);
+    table_free(&vm->strings);
+    vm->init_string = NULL;
     free_objects();
+    free_bytecode();
+#ifdef DEBUG_OPCODE_STATS
+    free_opcode_stats(vm->opcode_stats);
+#endif
+    vm = caller;
+}
+
+/* a VM of its own on the heap, for embedders */
+vm_t *
+new_vm(void)
+{
+    vm_t *context = (vm_t *)malloc(sizeof(vm_t));
+    if (context == NULL) {
+        fprintf(stderr, "Not enough memory for a VM.\n");
+        exit(EXIT_FAILURE);
+    }
+    vm_init(context);
+    return context;
+}
+
+void
+delete_vm(vm_t *context)
+{
+    free_vm(context);
+    free(context);
 }
 
 void
 push(value_t value)
 {
-    *vm.stack_top++ = value;
+    *vm->stack_top++ = value;
 }
 
 value_t
 pop(void)
 {
-    return *--vm.stack_top;
+    return *--vm->stack_top;
 }
 
 static value_t
 peek(int distance)
 {
-    return vm.stack_top[-1 - distance];
+    return vm->stack_top[-1 - distance];
 }
 
+/* call() and the rest of the call and return paths take the VM as an
+ * argument named like the thread-local, so run() can keep it in a
+ * register instead of reloading it after everything that isn't inlined */
 static bool
-call(obj_closure *closure, int arg_count)
+call(vm_t *vm, obj_closure *closure, int arg_count)
 {
     if (arg_count != closure->function->arity) {
         runtime_error("Expected %d arguments but got %d.",
@@ -123,31 +275,55 @@ call(obj_closure *closure, int arg_count)
                       arg_count);
         return false;
     }
-    if (vm.frame_count == FRAMES_MAX) {
+    /* leave a byte's worth of slots above the locals for temporaries */
+    value_t *slots = vm->stack_top - arg_count - 1;
+    if (vm->frame_count == FRAMES_MAX ||
+        slots + closure->function->max_slots + UINT8_COUNT >
+          vm->stack + STACK_MAX) {
         runtime_error("Stack overflow.");
         return false;
     }
 
-    call_frame_t *frame = &vm.frames[vm.frame_count++];
+    call_frame_t *frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = slots;
     return true;
 }
 
 static bool
-invoke_from_class(obj_class *class, obj_string *name, int arg_count)
+invoke_from_class(vm_t *vm,
+                  obj_class *class,
+                  obj_string *name,
+                  int arg_count,
+                  method_cache_t *cache)
 {
-    value_t method;
-    if (!table_get(&class->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
-        return false;
+    if (cache->class != class || cache->version != class->version) {
+        value_t method;
+        if (!table_get(&class->methods, name, &method)) {
+            runtime_error("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        /* the cache belongs to the running function */
+        call_frame_t *frame = &vm->frames[vm->frame_count - 1];
+        obj_t *function = &frame->closure->function->obj;
+        bool marking = begin_write(function);
+        if (marking) {
+            shade(obj_val((obj_t *)cache->class));
+            shade(cache->method);
+        }
+        cache->class = class;
+        cache->version = class->version;
+        cache->method = method;
+        end_write(marking);
+        write_barrier(function, obj_val((obj_t *)class));
+        write_barrier(function, method);
     }
-    return call(as_closure(method), arg_count);
+    return call(vm, as_closure(cache->method), arg_count);
 }
 
 static bool
-call_value(value_t callee, int arg_count)
+call_value(vm_t *vm, value_t callee, int arg_count)
 {
     if (!is_obj(callee))
         goto call_err;
@@ -155,16 +331,16 @@ call_value(value_t callee, int arg_count)
     switch (obj_type(callee)) {
         case OBJ_BOUND_METHOD: {
             obj_bound_method *bound = as_bound_method(callee);
-            vm.stack_top[-arg_count - 1] = bound->receiver;
-            return call(bound->method, arg_count);
+            vm->stack_top[-arg_count - 1] = bound->receiver;
+            return call(vm, bound->method, arg_count);
         }
         case OBJ_CLASS: {
             obj_class *class = as_class(callee);
-            vm.stack_top[-arg_count - 1] =
+            vm->stack_top[-arg_count - 1] =
               obj_val((obj_t *)newinstance(class));
             value_t initializer;
-            if (table_get(&class->methods, vm.init_string, &initializer)) {
-                return call(as_closure(initializer), arg_count);
+            if (table_get(&class->methods, vm->init_string, &initializer)) {
+                return call(vm, as_closure(initializer), arg_count);
             } else if (arg_count != 0) {
                 runtime_error("Expect - arguments but got %d.", arg_count);
                 return false;
@@ -172,11 +348,11 @@ call_value(value_t callee, int arg_count)
             return true;
         }
         case OBJ_CLOSURE:
-            return call(as_closure(callee), arg_count);
+            return call(vm, as_closure(callee), arg_count);
         case OBJ_NATIVE: {
             native_fn native = as_native(callee);
-            value_t result = native(arg_count, vm.stack_top - arg_count);
-            vm.stack_top -= arg_count + 1;
+            value_t result = native(arg_count, vm->stack_top - arg_count);
+            vm->stack_top -= arg_count + 1;
             push(result);
             return true;
         }
@@ -190,15 +366,15 @@ call_err:
 }
 
 static bool
-invoke(obj_string *name, int arg_count)
+invoke(vm_t *vm, obj_string *name, int arg_count, method_cache_t *cache)
 {
-    value_t receiver = peek(arg_count);
+    value_t receiver = vm->stack_top[-1 - arg_count];
     if (!is_instance(receiver)) {
         runtime_error("Only instances have methods.");
         return false;
     }
     obj_instance *instance = as_instance(receiver);
-    return invoke_from_class(instance->class, name, arg_count);
+    return invoke_from_class(vm, instance->class, name, arg_count, cache);
 }
 
 static bool
@@ -216,11 +392,44 @@ bind_method(obj_class *class, obj_string *name)
     return true;
 }
 
+/* uncached property access for the long forms, the instance is replaced by
+ * the value on the stack */
+static bool
+get_property(obj_string *name)
+{
+    if (!is_instance(peek(0))) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
+    obj_instance *instance = as_instance(peek(0));
+    value_t value;
+    if (instance_get_field(instance, name, &value)) {
+        pop();
+        push(value);
+        return true;
+    }
+    return bind_method(instance->class, name);
+}
+
+static bool
+set_property(obj_string *name)
+{
+    if (!is_instance(peek(1))) {
+        runtime_error("Only instances have fields.");
+        return false;
+    }
+    instance_set_field(as_instance(peek(1)), name, peek(0));
+    value_t value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
 static obj_upvalue *
-capture_upvalue(value_t *local)
+capture_upvalue(vm_t *vm, value_t *local)
 {
     obj_upvalue *prev_upvalue = NULL;
-    obj_upvalue *upvalue = vm.open_upvalues;
+    obj_upvalue *upvalue = vm->open_upvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prev_upvalue = upvalue;
         upvalue = upvalue->next;
@@ -230,20 +439,20 @@ capture_upvalue(value_t *local)
     obj_upvalue *created_upvalue = newupvalue(local);
     created_upvalue->next = upvalue;
     if (prev_upvalue == NULL)
-        vm.open_upvalues = created_upvalue;
+        vm->open_upvalues = created_upvalue;
     else
         prev_upvalue->next = created_upvalue;
     return created_upvalue;
 }
 
 static void
-close_upvalues(value_t *last)
+close_upvalues(vm_t *vm, value_t *last)
 {
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-        obj_upvalue *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
+    while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
+        obj_upvalue *upvalue = vm->open_upvalues;
+        write_field(&upvalue->obj, &upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+        vm->open_upvalues = upvalue->next;
     }
 }
 
@@ -252,10 +461,88 @@ method_define(obj_string *name)
 {
     value_t method = peek(0);
     obj_class *class = as_class(peek(1));
-    table_set(&class->methods, name, method);
+    write_entry(&class->obj, &class->methods, name, method);
+    class->version++;
     pop();
 }
 
+/* moves instance to next, a shape adding one field, and stores value in
+ * the new field. the field array has to have room for it */
+static void
+extend_old_instance(obj_instance *instance, obj_shape *next, value_t value)
+{
+    bool marking = begin_write(&instance->obj);
+    if (marking)
+        shade(obj_val((obj_t *)instance->shape));
+    instance->fields[next->slot_count - 1] = value;
+    instance->shape = next;
+    end_write(marking);
+    write_barrier(&instance->obj, value);
+    write_barrier(&instance->obj, obj_val((obj_t *)next));
+}
+
+static inline void
+extend_instance(obj_instance *instance, obj_shape *next, value_t value)
+{
+    if (instance->obj.is_old) {
+        extend_old_instance(instance, next, value);
+        return;
+    }
+    instance->fields[next->slot_count - 1] = value;
+    instance->shape = next;
+}
+
+static inline cache_entry_t *
+cache_lookup(inline_cache_t *cache, obj_shape *shape, uint32_t version)
+{
+    for (int i = 0; i < cache->count && i < PROPERTY_CACHE_WAYS; i++) {
+        cache_entry_t *entry = &cache->entries[i];
+        if (entry->shape == shape && entry->version == version)
+            return entry;
+    }
+    return NULL;
+}
+
+static void
+cache_update(inline_cache_t *cache,
+             obj_shape *shape,
+             obj_shape *next_shape,
+             uint32_t version,
+             int slot,
+             value_t method)
+{
+    /* the caches belong to the running function */
+    call_frame_t *frame = &vm->frames[vm->frame_count - 1];
+    obj_t *function = &frame->closure->function->obj;
+    bool marking = begin_write(function);
+    cache_entry_t *entry = NULL;
+    for (int i = 0; i < cache->count && i < PROPERTY_CACHE_WAYS; i++)
+        if (cache->entries[i].shape == shape)
+            entry = &cache->entries[i];
+
+    if (entry == NULL) {
+        if (cache->count >= PROPERTY_CACHE_WAYS) {
+            cache->count = PROPERTY_CACHE_WAYS + 1;
+            end_write(marking);
+            return;
+        }
+        entry = &cache->entries[cache->count++];
+    } else if (marking) {
+        shade(obj_val((obj_t *)entry->next_shape));
+        shade(entry->method);
+    }
+    entry->shape = shape;
+    entry->next_shape = next_shape;
+    entry->version = version;
+    entry->slot = slot;
+    entry->method = method;
+    end_write(marking);
+    write_barrier(function, obj_val((obj_t *)shape));
+    if (next_shape != NULL)
+        write_barrier(function, obj_val((obj_t *)next_shape));
+    write_barrier(function, method);
+}
+
 static bool
 is_falsey(value_t value)
 {
@@ -280,316 +567,808 @@ concatenate(void)
     push(obj_val((obj_t *)result));
 }
 
-static inline uint8_t
-read_byte(call_frame_t *frame)
+static interpret_result
+run(vm_t *vm)
 {
-    return *frame->ip++;
-}
+    /* the hot interpreter state lives in locals so the compiler can keep it
+     * in registers; it is written back to the frame and vm->stack_top before
+     * anything that can allocate, report an error or push a new frame */
+    call_frame_t *frame;
+    uint8_t *ip;
+    value_t *sp;
+    value_t *slots;
+    value_t *constants;
+    inline_cache_t *caches;
+    method_cache_t *method_caches;
 
-static inline uint16_t
-read_short(call_frame_t *frame)
-{
-    frame->ip += 2;
-    return (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]);
-}
+#define LOAD_FRAME()                                                          \
+    do {                                                                      \
+        frame = &vm->frames[vm->frame_count - 1];                             \
+        ip = frame->ip;                                                       \
+        slots = frame->slots;                                                 \
+        constants = frame->closure->function->chunk.constants.values;         \
+        caches = frame->closure->function->chunk.caches;                      \
+        method_caches = frame->closure->function->chunk.method_caches;        \
+        sp = vm->stack_top;                                                   \
+    } while (0)
+#define STORE_FRAME()                                                         \
+    do {                                                                      \
+        frame->ip = ip;                                                       \
+        vm->stack_top = sp;                                                   \
+    } while (0)
 
-static inline value_t
-read_constant(call_frame_t *frame)
-{
-    return frame->closure->function->chunk.constants.values[read_byte(frame)];
-}
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() as_string(READ_CONSTANT())
+#define READ_CONSTANT_LONG() (constants[READ_SHORT()])
+#define READ_STRING_LONG() as_string(READ_CONSTANT_LONG())
+    /* for handlers shared by an op and its long form, only valid before any
+     * operand has been read */
+#define READ_NAME(long_op)                                                    \
+    (ip[-1] == (long_op) ? READ_STRING_LONG() : READ_STRING())
+#define READ_CACHE() (&caches[READ_SHORT()])
+#define READ_METHOD_CACHE() (&method_caches[READ_SHORT()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
 
-static inline obj_string *
-read_string(call_frame_t *frame)
-{
-    return as_string(read_constant(frame));
-}
+    /* where the collector gets to run minor collections, which move objects,
+     * and marking slices. the first thing in the handlers of backward jumps
+     * and calls so no object pointer is held across it and every loop
+     * reaches one */
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT()                                                           \
+    do {                                                                      \
+        STORE_FRAME();                                                        \
+        collect_at_safepoint();                                               \
+        LOAD_FRAME();                                                         \
+    } while (0)
+#else
+#define SAFEPOINT()                                                           \
+    do {                                                                      \
+        if (vm->gc_pending) {                                                 \
+            STORE_FRAME();                                                    \
+            collect_at_safepoint();                                           \
+            LOAD_FRAME();                                                     \
+        }                                                                     \
+    } while (0)
+#endif
 
-static interpret_result
-run(void)
-{
-    call_frame_t *frame = &vm.frames[vm.frame_count - 1];
-#define BINARY_OP(value_type, op)                                             \
+#define RUNTIME_ERROR(...)                                                    \
+    do {                                                                      \
+        STORE_FRAME();                                                        \
+        runtime_error(__VA_ARGS__);                                           \
+        return INTERPRET_RUNTIME_ERROR;                                       \
+    } while (0)
+
+    /* rewrite the op just read into a specialized form, or back again */
+#define QUICKEN(length, op) (ip[-(length)] = (op))
+#define DEOPTIMIZE(op)                                                        \
+    do {                                                                      \
+        ip[-1] = (op);                                                        \
+        ip--;                                                                 \
+        DISPATCH();                                                           \
+    } while (0)
+
+    /* operate on the two top slots in place instead of pop, pop, push */
+#define BINARY_OP(value_type, op, quickened)                                  \
+    do {                                                                      \
+        if (!is_number(PEEK(0)) || !is_number(PEEK(1)))                       \
+            RUNTIME_ERROR("Operands must be numbers.");                       \
+        QUICKEN(1, quickened);                                                \
+        double b = as_number(sp[-1]);                                         \
+        double a = as_number(sp[-2]);                                         \
+        sp[-2] = value_type(a op b);                                          \
+        sp--;                                                                 \
+    } while (0)
+#define NUMBER_OP(value_type, op, generic)                                    \
     do {                                                                      \
-        if (!is_number(peek(0)) || !is_number(peek(1))) {                     \
-            runtime_error("Operands must be numbers.");                       \
-            return INTERPRET_RUNTIME_ERROR;                                   \
+        if (!is_number(PEEK(0)) || !is_number(PEEK(1)))                       \
+            DEOPTIMIZE(generic);                                              \
+        double b = as_number(sp[-1]);                                         \
+        double a = as_number(sp[-2]);                                         \
+        sp[-2] = value_type(a op b);                                          \
+        sp--;                                                                 \
+    } while (0)
+
+    /* a and b must already be off the stack, strings go back on it so they
+     * stay reachable while concatenate allocates */
+#define ADD_VALUES(a, b)                                                      \
+    do {                                                                      \
+        if (is_number(a) && is_number(b)) {                                   \
+            PUSH(number_val(as_number(a) + as_number(b)));                    \
+        } else if (is_string(a) && is_string(b)) {                            \
+            PUSH(a);                                                          \
+            PUSH(b);                                                          \
+            STORE_FRAME();                                                    \
+            concatenate();                                                    \
+            sp = vm->stack_top;                                               \
+        } else {                                                              \
+            RUNTIME_ERROR("Operands must be two numbers or two strings.");    \
         }                                                                     \
-        double b = as_number(pop());                                          \
-        double a = as_number(pop());                                          \
-        push(value_type(a op b));                                             \
     } while (0)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (value_t *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(
-          &frame->closure->function->chunk,
-          (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION()                                                     \
+    do {                                                                      \
+        printf("          ");                                                 \
+        for (value_t *slot = vm->stack; slot < sp; slot++) {                  \
+            printf("[ ");                                                     \
+            print_value(*slot);                                               \
+            printf(" ]");                                                     \
+        }                                                                     \
+        printf("\n");                                                         \
+        disassemble_instruction(                                              \
+          &frame->closure->function->chunk,                                   \
+          (int)(ip - frame->closure->function->chunk.code));                  \
+    } while (0)
+#else
+#define TRACE_EXECUTION()                                                     \
+    do {                                                                      \
+    } while (0)
 #endif
-        op_code instruction;
-        switch (instruction = read_byte(frame)) {
-            case OP_CONSTANT: {
-                value_t constant = read_constant(frame);
-                push(constant);
-                break;
-            }
-            case OP_NIL:
-                push(nil_val());
-                break;
-            case OP_TRUE:
-                push(bool_val(true));
-                break;
-            case OP_FALSE:
-                push(bool_val(false));
-                break;
-            case OP_POP:
-                pop();
-                break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = read_byte(frame);
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = read_byte(frame);
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                obj_string *name = read_string(frame);
+
+#ifdef DEBUG_OPCODE_STATS
+#define NEXT_OPCODE() (count_opcode(vm->opcode_stats, *ip), READ_BYTE())
+#else
+#define NEXT_OPCODE() READ_BYTE()
+#endif
+
+#ifdef COMPUTED_GOTO
+#define LABEL(op) (__extension__ &&op_##op)
+    /* every handler ends in its own indirect jump so the branch predictor
+     * gets one history per opcode instead of a single shared one */
+    static void *dispatch_table[] = {
+        [OP_CONSTANT] = LABEL(OP_CONSTANT),
+        [OP_NIL] = LABEL(OP_NIL),
+        [OP_TRUE] = LABEL(OP_TRUE),
+        [OP_FALSE] = LABEL(OP_FALSE),
+        [OP_POP] = LABEL(OP_POP),
+        [OP_GET_LOCAL] = LABEL(OP_GET_LOCAL),
+        [OP_SET_LOCAL] = LABEL(OP_SET_LOCAL),
+        [OP_GET_GLOBAL] = LABEL(OP_GET_GLOBAL),
+        [OP_DEFINE_GLOBAL] = LABEL(OP_DEFINE_GLOBAL),
+        [OP_SET_GLOBAL] = LABEL(OP_SET_GLOBAL),
+        [OP_GET_UPVALUE] = LABEL(OP_GET_UPVALUE),
+        [OP_SET_UPVALUE] = LABEL(OP_SET_UPVALUE),
+        [OP_GET_PROPERTY] = LABEL(OP_GET_PROPERTY),
+        [OP_SET_PROPERTY] = LABEL(OP_SET_PROPERTY),
+        [OP_GET_SUPER] = LABEL(OP_GET_SUPER),
+        [OP_EQUAL] = LABEL(OP_EQUAL),
+        [OP_GREATER] = LABEL(OP_GREATER),
+        [OP_LESS] = LABEL(OP_LESS),
+        [OP_ADD] = LABEL(OP_ADD),
+        [OP_SUBTRACT] = LABEL(OP_SUBTRACT),
+        [OP_MULTIPLY] = LABEL(OP_MULTIPLY),
+        [OP_DIVIDE] = LABEL(OP_DIVIDE),
+        [OP_NOT] = LABEL(OP_NOT),
+        [OP_NEGATE] = LABEL(OP_NEGATE),
+        [OP_PRINT] = LABEL(OP_PRINT),
+        [OP_JUMP] = LABEL(OP_JUMP),
+        [OP_JUMP_IF_FALSE] = LABEL(OP_JUMP_IF_FALSE),
+        [OP_JUMP_IF_TRUE] = LABEL(OP_JUMP_IF_TRUE),
+        [OP_LOOP] = LABEL(OP_LOOP),
+        [OP_CALL] = LABEL(OP_CALL),
+        [OP_INVOKE] = LABEL(OP_INVOKE),
+        [OP_SUPER_INVOKE] = LABEL(OP_SUPER_INVOKE),
+        [OP_CLOSURE] = LABEL(OP_CLOSURE),
+        [OP_CLOSE_UPVALUE] = LABEL(OP_CLOSE_UPVALUE),
+        [OP_RETURN] = LABEL(OP_RETURN),
+        [OP_CLASS] = LABEL(OP_CLASS),
+        [OP_INHERIT] = LABEL(OP_INHERIT),
+        [OP_METHOD] = LABEL(OP_METHOD),
+        [OP_CONSTANT_LONG] = LABEL(OP_CONSTANT_LONG),
+        [OP_GET_LOCAL_LONG] = LABEL(OP_GET_LOCAL_LONG),
+        [OP_SET_LOCAL_LONG] = LABEL(OP_SET_LOCAL_LONG),
+        [OP_GET_UPVALUE_LONG] = LABEL(OP_GET_UPVALUE_LONG),
+        [OP_SET_UPVALUE_LONG] = LABEL(OP_SET_UPVALUE_LONG),
+        [OP_GET_PROPERTY_LONG] = LABEL(OP_GET_PROPERTY_LONG),
+        [OP_SET_PROPERTY_LONG] = LABEL(OP_SET_PROPERTY_LONG),
+        [OP_GET_SUPER_LONG] = LABEL(OP_GET_SUPER_LONG),
+        [OP_INVOKE_LONG] = LABEL(OP_INVOKE_LONG),
+        [OP_SUPER_INVOKE_LONG] = LABEL(OP_SUPER_INVOKE_LONG),
+        [OP_CLOSURE_LONG] = LABEL(OP_CLOSURE_LONG),
+        [OP_CLASS_LONG] = LABEL(OP_CLASS_LONG),
+        [OP_METHOD_LONG] = LABEL(OP_METHOD_LONG),
+        [OP_ADD_LOCAL_LOCAL] = LABEL(OP_ADD_LOCAL_LOCAL),
+        [OP_ADD_LOCAL_CONSTANT] = LABEL(OP_ADD_LOCAL_CONSTANT),
+        [OP_SUBTRACT_LOCAL_CONSTANT] = LABEL(OP_SUBTRACT_LOCAL_CONSTANT),
+        [OP_LESS_LOCAL_CONSTANT_JUMP] = LABEL(OP_LESS_LOCAL_CONSTANT_JUMP),
+        [OP_ADD_NUMBER] = LABEL(OP_ADD_NUMBER),
+        [OP_ADD_STRING] = LABEL(OP_ADD_STRING),
+        [OP_SUBTRACT_NUMBER] = LABEL(OP_SUBTRACT_NUMBER),
+        [OP_MULTIPLY_NUMBER] = LABEL(OP_MULTIPLY_NUMBER),
+        [OP_DIVIDE_NUMBER] = LABEL(OP_DIVIDE_NUMBER),
+        [OP_GREATER_NUMBER] = LABEL(OP_GREATER_NUMBER),
+        [OP_LESS_NUMBER] = LABEL(OP_LESS_NUMBER),
+        [OP_GET_FIELD] = LABEL(OP_GET_FIELD),
+        [OP_SET_FIELD] = LABEL(OP_SET_FIELD),
+    };
+#define DISPATCH()                                                            \
+    do {                                                                      \
+        TRACE_EXECUTION();                                                    \
+        __extension__({ goto *dispatch_table[NEXT_OPCODE()]; });              \
+    } while (0)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) op_##op
+#else
+#define DISPATCH() goto loop
+#define INTERPRET_LOOP                                                        \
+    loop:                                                                     \
+    TRACE_EXECUTION();                                                        \
+    switch (NEXT_OPCODE())
+#define CASE(op) case op
+#endif
+
+    LOAD_FRAME();
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT):
+            PUSH(READ_CONSTANT());
+            DISPATCH();
+        CASE(OP_NIL):
+            PUSH(nil_val());
+            DISPATCH();
+        CASE(OP_TRUE):
+            PUSH(bool_val(true));
+            DISPATCH();
+        CASE(OP_FALSE):
+            PUSH(bool_val(false));
+            DISPATCH();
+        CASE(OP_POP):
+            sp--;
+            DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            value_t value = vm->globals.values[index];
+            if (is_undefined(value))
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              as_cstring(vm->global_names.values[index]));
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            vm->globals.values[index] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t index = READ_SHORT();
+            if (is_undefined(vm->globals.values[index]))
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              as_cstring(vm->global_names.values[index]));
+            vm->globals.values[index] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            obj_upvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+            write_field(&upvalue->obj, upvalue->location, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            if (!is_instance(PEEK(0)))
+                RUNTIME_ERROR("Only instances have properties.");
+            obj_instance *instance = as_instance(PEEK(0));
+            obj_class *class = instance->class;
+            obj_string *name = READ_STRING();
+            inline_cache_t *cache = READ_CACHE();
+
+            value_t method;
+            cache_entry_t *entry =
+              cache_lookup(cache, instance->shape, class->version);
+            if (entry != NULL) {
+                if (entry->slot != -1) {
+                    if (cache->count == 1)
+                        QUICKEN(4, OP_GET_FIELD);
+                    sp[-1] = instance->fields[entry->slot];
+                    DISPATCH();
+                }
+                method = entry->method;
+            } else if (instance->shape == NULL) {
                 value_t value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if (table_get(instance->dictionary, name, &value)) {
+                    sp[-1] = value;
+                    DISPATCH();
                 }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                obj_string *name = read_string(frame);
-                /* don't pop until after adding the value to the hash table
-                 * this ensures the value doesn't get garbage collected
-                 */
-                table_set(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                obj_string *name = read_string(frame);
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!table_get(&class->methods, name, &method))
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+            } else {
+                int slot = shape_find_slot(instance->shape, name);
+                if (slot != -1) {
+                    cache_update(cache,
+                                 instance->shape,
+                                 NULL,
+                                 class->version,
+                                 slot,
+                                 nil_val());
+                    sp[-1] = instance->fields[slot];
+                    DISPATCH();
                 }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = read_byte(frame);
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = read_byte(frame);
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                if (!table_get(&class->methods, name, &method))
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                cache_update(
+                  cache, instance->shape, NULL, class->version, -1, method);
             }
-            case OP_GET_PROPERTY: {
-                if (!is_instance(peek(0))) {
-                    runtime_error("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                obj_instance *instance = as_instance(peek(0));
-                obj_string *name = read_string(frame);
 
-                value_t value;
-                if (table_get(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
-                }
+            STORE_FRAME();
+            obj_bound_method *bound =
+              newbound_method(PEEK(0), as_closure(method));
+            sp[-1] = obj_val((obj_t *)bound);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            if (!is_instance(PEEK(1)))
+                RUNTIME_ERROR("Only instances have fields.");
+            obj_instance *instance = as_instance(PEEK(1));
+            obj_class *class = instance->class;
+            obj_string *name = READ_STRING();
+            inline_cache_t *cache = READ_CACHE();
 
-                if (!bind_method(instance->class, name))
-                    return INTERPRET_RUNTIME_ERROR;
-                break;
-            }
-            case OP_SET_PROPERTY: {
-                if (!is_instance(peek(1))) {
-                    runtime_error("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                obj_instance *instance = as_instance(peek(1));
-                table_set(&instance->fields, read_string(frame), peek(0));
-                value_t value = pop();
-                pop();
-                push(value);
-                break;
+            cache_entry_t *entry =
+              cache_lookup(cache, instance->shape, class->version);
+            if (entry != NULL && entry->next_shape == NULL) {
+                if (cache->count == 1)
+                    QUICKEN(4, OP_SET_FIELD);
+                write_field(
+                  &instance->obj, &instance->fields[entry->slot], PEEK(0));
+            } else if (entry != NULL &&
+                       entry->slot < instance->field_capacity) {
+                if (cache->count == 1)
+                    QUICKEN(4, OP_SET_FIELD);
+                extend_instance(instance, entry->next_shape, PEEK(0));
+            } else {
+                STORE_FRAME();
+                obj_shape *shape = instance->shape;
+                instance_set_field(instance, name, PEEK(0));
+                if (shape != NULL && instance->shape != NULL)
+                    cache_update(cache,
+                                 shape,
+                                 instance->shape != shape ? instance->shape
+                                                          : NULL,
+                                 class->version,
+                                 shape_find_slot(instance->shape, name),
+                                 nil_val());
             }
-            case OP_GET_SUPER: {
-                obj_string *name = read_string(frame);
-                obj_class *superclass = as_class(pop());
+            sp[-2] = sp[-1];
+            sp--;
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER_LONG):
+        CASE(OP_GET_SUPER): {
+            obj_string *name = READ_NAME(OP_GET_SUPER_LONG);
+            obj_class *superclass = as_class(POP());
 
-                if (!bind_method(superclass, name))
-                    return INTERPRET_RUNTIME_ERROR;
-                break;
-            }
-            case OP_EQUAL: {
-                value_t b = pop();
-                value_t a = pop();
-                push(bool_val(values_equal(a, b)));
-                break;
-            }
-            case OP_GREATER:
-                BINARY_OP(bool_val, >);
-                break;
-            case OP_LESS:
-                BINARY_OP(bool_val, <);
-                break;
-            case OP_ADD: {
-                if (is_string(peek(0)) && is_string(peek(1)))
-                    concatenate();
-                else if (is_number(peek(0)) && is_number(peek(1))) {
-                    double b = as_number(pop());
-                    double a = as_number(pop());
-                    push(number_val(a + b));
-                } else {
-                    runtime_error(
-                      "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT:
-                BINARY_OP(number_val, -);
-                break;
-            case OP_MULTIPLY:
-                BINARY_OP(number_val, *);
-                break;
-            case OP_DIVIDE:
-                BINARY_OP(number_val, /);
-                break;
-            case OP_NOT:
-                push(bool_val(is_falsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!is_number(peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(number_val(-as_number(pop())));
-                break;
-            case OP_PRINT:
-                print_value(pop());
-                printf("\n");
-                break;
-            case OP_JUMP:
-                frame->ip += read_short(frame);
-                break;
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = read_short(frame);
-                if (is_falsey(peek(0)))
-                    frame->ip += offset;
-                break;
-            }
-            case OP_LOOP:
-                frame->ip -= read_short(frame);
-                break;
-            case OP_CALL: {
-                int arg_count = read_byte(frame);
-                if (!call_value(peek(arg_count), arg_count))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_INVOKE: {
-                obj_string *method = read_string(frame);
-                int arg_count = read_byte(frame);
-                if (!invoke(method, arg_count))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                obj_string *method = read_string(frame);
-                int arg_count = read_byte(frame);
-                obj_class *superclass = as_class(pop());
-                if (!invoke_from_class(superclass, method, arg_count))
-                    return INTERPRET_RUNTIME_ERROR;
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                obj_function *function = as_function(read_constant(frame));
-                obj_closure *closure = newclosure(function);
-                push(obj_val((obj_t *)closure));
-                for (int i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = read_byte(frame);
-                    uint8_t index = read_byte(frame);
-                    if (is_local)
-                        closure->upvalues[i] =
-                          capture_upvalue(frame->slots + index);
-                    else
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-                break;
-            }
-            case OP_CLOSE_UPVALUE:
-                close_upvalues(vm.stack_top - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                value_t result = pop();
-                close_upvalues(frame->slots);
-                if (--vm.frame_count == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            STORE_FRAME();
+            if (!bind_method(superclass, name))
+                return INTERPRET_RUNTIME_ERROR;
+            sp = vm->stack_top;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            value_t b = POP();
+            sp[-1] = bool_val(values_equal(sp[-1], b));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):
+            BINARY_OP(bool_val, >, OP_GREATER_NUMBER);
+            DISPATCH();
+        CASE(OP_LESS):
+            BINARY_OP(bool_val, <, OP_LESS_NUMBER);
+            DISPATCH();
+        CASE(OP_ADD): {
+            if (is_number(PEEK(0)) && is_number(PEEK(1)))
+                QUICKEN(1, OP_ADD_NUMBER);
+            else if (is_string(PEEK(0)) && is_string(PEEK(1)))
+                QUICKEN(1, OP_ADD_STRING);
+            value_t b = POP();
+            value_t a = POP();
+            ADD_VALUES(a, b);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT):
+            BINARY_OP(number_val, -, OP_SUBTRACT_NUMBER);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            BINARY_OP(number_val, *, OP_MULTIPLY_NUMBER);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            BINARY_OP(number_val, /, OP_DIVIDE_NUMBER);
+            DISPATCH();
+        CASE(OP_NOT):
+            sp[-1] = bool_val(is_falsey(sp[-1]));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!is_number(PEEK(0)))
+                RUNTIME_ERROR("Operand must be a number.");
+            sp[-1] = number_val(-as_number(sp[-1]));
+            DISPATCH();
+        CASE(OP_PRINT):
+            fprint_value(vm->out, POP());
+            fputs("\n", vm->out);
+            DISPATCH();
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(PEEK(0)))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!is_falsey(PEEK(0)))
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            SAFEPOINT();
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            SAFEPOINT();
+            int arg_count = READ_BYTE();
+            STORE_FRAME();
+            if (!call_value(vm, PEEK(arg_count), arg_count))
+                return INTERPRET_RUNTIME_ERROR;
+            /* compact() has its pause before the script goes on */
+            if (vm->compact_pending)
+                collect_at_safepoint();
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_LONG):
+        CASE(OP_INVOKE): {
+            SAFEPOINT();
+            obj_string *method = READ_NAME(OP_INVOKE_LONG);
+            int arg_count = READ_BYTE();
+            method_cache_t *cache = READ_METHOD_CACHE();
+            STORE_FRAME();
+            if (!invoke(vm, method, arg_count, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_LONG):
+        CASE(OP_SUPER_INVOKE): {
+            SAFEPOINT();
+            obj_string *method = READ_NAME(OP_SUPER_INVOKE_LONG);
+            int arg_count = READ_BYTE();
+            method_cache_t *cache = READ_METHOD_CACHE();
+            obj_class *superclass = as_class(POP());
+            STORE_FRAME();
+            if (!invoke_from_class(vm, superclass, method, arg_count, cache))
+                return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE_LONG):
+        CASE(OP_CLOSURE): {
+            bool wide = ip[-1] == OP_CLOSURE_LONG;
+            obj_function *function =
+              as_function(wide ? READ_CONSTANT_LONG() : READ_CONSTANT());
+            STORE_FRAME();
+            obj_closure *closure = newclosure(function);
+            PUSH(obj_val((obj_t *)closure));
+            /* capture_upvalue allocates, keep the new closure rooted */
+            vm->stack_top = sp;
+            for (int i = 0; i < closure->upvalue_count; i++) {
+                uint8_t is_local = READ_BYTE();
+                uint16_t index = wide ? READ_SHORT() : READ_BYTE();
+                if (is_local)
+                    closure->upvalues[i] = capture_upvalue(vm, slots + index);
+                else
+                    closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            case OP_CLASS:
-                push(obj_val((obj_t *)newclass(read_string(frame))));
-                break;
-            case OP_INHERIT: {
-                value_t superclass = peek(1);
-                if (!is_class(superclass)) {
-                    runtime_error("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                obj_class *subclass = as_class(peek(0));
-                table_add_all(&as_class(superclass)->methods,
-                              &subclass->methods);
-                pop();
-                break;
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            close_upvalues(vm, sp - 1);
+            sp--;
+            DISPATCH();
+        CASE(OP_RETURN): {
+            value_t result = POP();
+            close_upvalues(vm, slots);
+            if (--vm->frame_count == 0) {
+                vm->stack_top = sp - 1;
+                return INTERPRET_OK;
             }
-            case OP_METHOD:
-                method_define(read_string(frame));
-                break;
+            *slots = result;
+            vm->stack_top = slots + 1;
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS_LONG):
+        CASE(OP_CLASS): {
+            obj_string *name = READ_NAME(OP_CLASS_LONG);
+            STORE_FRAME();
+            PUSH(obj_val((obj_t *)newclass(name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            value_t superclass = PEEK(1);
+            if (!is_class(superclass))
+                RUNTIME_ERROR("Superclass must be a class.");
+            obj_class *subclass = as_class(PEEK(0));
+            STORE_FRAME();
+            /* the subclass has no methods of its own to overwrite yet */
+            bool marking = begin_write(&subclass->obj);
+            table_add_all(&as_class(superclass)->methods, &subclass->methods);
+            end_write(marking);
+            remember(&subclass->obj);
+            subclass->version++;
+            sp--;
+            DISPATCH();
+        }
+        CASE(OP_METHOD_LONG):
+        CASE(OP_METHOD): {
+            obj_string *name = READ_NAME(OP_METHOD_LONG);
+            STORE_FRAME();
+            method_define(name);
+            sp = vm->stack_top;
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG):
+            PUSH(READ_CONSTANT_LONG());
+            DISPATCH();
+        CASE(OP_GET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_LONG): {
+            obj_upvalue *upvalue = frame->closure->upvalues[READ_SHORT()];
+            write_field(&upvalue->obj, upvalue->location, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_LONG): {
+            obj_string *name = READ_STRING_LONG();
+            STORE_FRAME();
+            if (!get_property(name))
+                return INTERPRET_RUNTIME_ERROR;
+            sp = vm->stack_top;
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY_LONG): {
+            obj_string *name = READ_STRING_LONG();
+            STORE_FRAME();
+            if (!set_property(name))
+                return INTERPRET_RUNTIME_ERROR;
+            sp = vm->stack_top;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_LOCAL): {
+            value_t a = slots[READ_BYTE()];
+            value_t b = slots[READ_BYTE()];
+            ADD_VALUES(a, b);
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            value_t a = slots[READ_BYTE()];
+            value_t b = READ_CONSTANT();
+            ADD_VALUES(a, b);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+            value_t a = slots[READ_BYTE()];
+            value_t b = READ_CONSTANT();
+            if (!is_number(a) || !is_number(b))
+                RUNTIME_ERROR("Operands must be numbers.");
+            PUSH(number_val(as_number(a) - as_number(b)));
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP): {
+            value_t a = slots[READ_BYTE()];
+            value_t b = READ_CONSTANT();
+            if (!is_number(a) || !is_number(b))
+                RUNTIME_ERROR("Operands must be numbers.");
+            uint16_t offset = READ_SHORT();
+            bool less = as_number(a) < as_number(b);
+            PUSH(bool_val(less));
+            if (!less)
+                ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER):
+            NUMBER_OP(number_val, +, OP_ADD);
+            DISPATCH();
+        CASE(OP_ADD_STRING):
+            if (!is_string(PEEK(0)) || !is_string(PEEK(1)))
+                DEOPTIMIZE(OP_ADD);
+            STORE_FRAME();
+            concatenate();
+            sp = vm->stack_top;
+            DISPATCH();
+        CASE(OP_SUBTRACT_NUMBER):
+            NUMBER_OP(number_val, -, OP_SUBTRACT);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUMBER):
+            NUMBER_OP(number_val, *, OP_MULTIPLY);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUMBER):
+            NUMBER_OP(number_val, /, OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_GREATER_NUMBER):
+            NUMBER_OP(bool_val, >, OP_GREATER);
+            DISPATCH();
+        CASE(OP_LESS_NUMBER):
+            NUMBER_OP(bool_val, <, OP_LESS);
+            DISPATCH();
+        CASE(OP_GET_FIELD): {
+            /* the guard runs before the operands are read so a failed one
+             * leaves ip on the opcode for the generic handler */
+            cache_entry_t *entry = &caches[(ip[1] << 8) | ip[2]].entries[0];
+            if (!is_instance(PEEK(0)) ||
+                as_instance(PEEK(0))->shape != entry->shape)
+                DEOPTIMIZE(OP_GET_PROPERTY);
+            ip += 3;
+            sp[-1] = as_instance(PEEK(0))->fields[entry->slot];
+            DISPATCH();
+        }
+        CASE(OP_SET_FIELD): {
+            cache_entry_t *entry = &caches[(ip[1] << 8) | ip[2]].entries[0];
+            if (!is_instance(PEEK(1)))
+                DEOPTIMIZE(OP_SET_PROPERTY);
+            obj_instance *instance = as_instance(PEEK(1));
+            if (instance->shape != entry->shape)
+                DEOPTIMIZE(OP_SET_PROPERTY);
+            if (entry->next_shape == NULL)
+                write_field(
+                  &instance->obj, &instance->fields[entry->slot], PEEK(0));
+            else if (entry->slot < instance->field_capacity)
+                extend_instance(instance, entry->next_shape, PEEK(0));
+            else
+                DEOPTIMIZE(OP_SET_PROPERTY);
+            ip += 3;
+            sp[-2] = sp[-1];
+            sp--;
+            DISPATCH();
         }
     }
+
+    return INTERPRET_RUNTIME_ERROR;
+#undef CASE
+#undef LABEL
+#undef INTERPRET_LOOP
+#undef DISPATCH
+#undef NEXT_OPCODE
+#undef TRACE_EXECUTION
+#undef ADD_VALUES
+#undef NUMBER_OP
 #undef BINARY_OP
+#undef DEOPTIMIZE
+#undef QUICKEN
+#undef RUNTIME_ERROR
+#undef SAFEPOINT
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef READ_METHOD_CACHE
+#undef READ_CACHE
+#undef READ_NAME
+#undef READ_STRING_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef STORE_FRAME
+#undef LOAD_FRAME
 }
 
-interpret_result
-interpret(const char *source)
+static interpret_result
+run_script(obj_function *function)
 {
-    obj_function *function = compile(source);
-    if (function == NULL)
-        return INTERPRET_COMPILE_ERROR;
-
     push(obj_val((obj_t *)function));
     obj_closure *closure = newclosure(function);
     pop();
     push(obj_val((obj_t *)closure));
-    call(closure, 0);
+    if (!call(vm, closure, 0))
+        return INTERPRET_RUNTIME_ERROR;
+
+    interpret_result result = run(vm);
+    /* nothing runs after a compact() at the very end to get it done */
+    if (vm->compact_pending)
+        collect_at_safepoint();
+    return result;
+}
+
+interpret_result
+interpret(vm_t *context, const char *source)
+{
+    vm_t *caller = vm;
+    vm = context;
+    obj_function *function = compile(source);
+    interpret_result result =
+      function != NULL ? run_script(function) : INTERPRET_COMPILE_ERROR;
+    vm = caller;
+    return result;
+}
+
+/* runs a script compiled ahead of time by lox --compile */
+interpret_result
+interpret_bytecode(vm_t *context, const char *path)
+{
+    vm_t *caller = vm;
+    vm = context;
+    obj_function *function = load_bytecode(path);
+    interpret_result result =
+      function != NULL ? run_script(function) : INTERPRET_COMPILE_ERROR;
+    vm = caller;
+    return result;
+}
 
-    return run();
+static char *
+read_source(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t file_size = ftell(file);
+    rewind(file);
+
+    char *buffer = (char *)malloc(file_size + 1);
+    size_t bytes_read =
+      buffer != NULL ? fread(buffer, sizeof(char), file_size, file) : 0;
+    fclose(file);
+    if (bytes_read < file_size || buffer == NULL) {
+        fprintf(vm->err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        return NULL;
+    }
+    buffer[bytes_read] = '\0';
+    return buffer;
+}
+
+/* runs the script or .loxc file at path, a file that can't be read counts
+ * as a compile error */
+interpret_result
+interpret_file(vm_t *context, const char *path)
+{
+    if (is_bytecode(path))
+        return interpret_bytecode(context, path);
+
+    vm_t *caller = vm;
+    vm = context;
+    char *source = read_source(path);
+    vm = caller;
+    if (source == NULL)
+        return INTERPRET_COMPILE_ERROR;
+    interpret_result result = interpret(context, source);
+    free(source);
+    return result;
 }
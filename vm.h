@@ -1,8 +1,11 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -25,22 +28,122 @@ typedef struct
     value_t *slots;
 } call_frame_t;
 
+/* a file mapped into memory that loaded code runs from in place */
+typedef struct
+{
+    void *start;
+    size_t size;
+} mapping_t;
+
+/* old objects are kept in pages of equal sized slots, a size class for
+ * every multiple of eight bytes up to the largest object */
+#define SLAB_CLASSES 16
+
+struct page;
+
+/* how long the collector held up the program. pauses are counted in a
+ * histogram with four buckets per power of two nanoseconds */
+#define GC_PAUSE_BUCKETS 256
+
+typedef struct
+{
+    long pause_count;
+    long minor_count;
+    long major_count;
+    long compact_count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    long pauses[GC_PAUSE_BUCKETS];
+} gc_stats_t;
+
 typedef struct
 {
     call_frame_t frames[FRAMES_MAX];
     int frame_count;
     value_t stack[STACK_MAX];
     value_t *stack_top;
-    table_t globals;
+    /* globals are resolved to indices at compile time, the table maps a
+     * name to its index and names are kept for error messages */
+    table_t global_slots;
+    value_array global_names;
+    value_array globals;
     table_t strings;
     obj_string *init_string;
     obj_upvalue *open_upvalues;
     size_t bytes_allocated;
     size_t next_gc;
-    obj_t *objects;
+    /* the pages old objects are in, with the slots free for each size
+     * class linked through next. young objects live in the nursery until
+     * they survive a minor collection */
+    struct page **pages;
+    int page_count;
+    int page_capacity;
+    obj_t *free_slots[SLAB_CLASSES];
+    /* pages a collection has marked but not swept yet, swept one at a time
+     * as their size class runs out of free slots */
+    struct page *unswept[SLAB_CLASSES];
+    /* emptied pages, kept to be used again */
+    struct page *page_pool;
+    char *nursery;
+    /* mark bits for the nursery, a bit for every eight bytes, set when a
+     * collection that stops the world finds a young object */
+    uint64_t *nursery_marks;
+    char *nursery_top;
+    char *nursery_end;
+    /* where allocating in the nursery stops to sweep a page while there are
+     * pages left to sweep, nursery_end otherwise */
+    char *nursery_limit;
+    bool nursery_full;
+    /* old objects written to since the last minor collection that may point
+     * into the nursery */
+    int remembered_count;
+    int remembered_capacity;
+    obj_t **remembered;
+    /* a major collection marks gc_slice objects at a time at safepoints in
+     * run() while gc_marking is set, or all at once if gc_slice is 0 or the
+     * heap reaches gc_limit first */
+    bool gc_marking;
+    int gc_slice;
+    size_t gc_limit;
+    /* with gc_thread set the marking is done by a collector thread instead,
+     * started the first time it's needed. it and this VM's thread take
+     * turns with the heap under gc_lock while gc_marking is set */
+    bool gc_thread;
+    bool collector_running;
+    bool collector_stop;
+    bool collector_yielded;
+    int gc_lock_depth;
+    atomic_bool gc_lock_wanted;
+    pthread_t collector;
+    pthread_mutex_t gc_lock;
+    pthread_cond_t collector_wake;
+    pthread_cond_t collector_resume;
+    /* set by the allocator or the collector thread when the next safepoint
+     * has work to do */
+    atomic_bool gc_pending;
+    gc_stats_t gc_stats;
+    /* how many threads a pause that marks the whole heap or sweeps it
+     * works with */
+    int gc_workers;
+    /* the percentage of the old generation's pages that have to be free
+     * for compacting to be worth it, 0 for never. compact_pending has the
+     * next safepoint do it */
+    int gc_compact;
+    bool compact_pending;
     int gray_count;
     int gray_capacity;
     obj_t **gray_stack;
+    /* unmapped by free_vm once nothing points into them */
+    int mapping_count;
+    int mapping_capacity;
+    mapping_t *mappings;
+#ifdef DEBUG_OPCODE_STATS
+    struct opcode_stats *opcode_stats;
+#endif
+    /* where print and error messages go, stdout and stderr unless the
+     * embedder points them somewhere else after vm_init */
+    FILE *out;
+    FILE *err;
 } vm_t;
 
 typedef enum
@@ -50,15 +153,33 @@ typedef enum
     INTERPRET_RUNTIME_ERROR,
 } interpret_result;
 
-extern vm_t vm;
+/* the VM the calling thread is working on. the functions taking a vm_t *
+ * make it current until they return, everything else uses it, so any
+ * number of VMs can run side by side as long as each sticks to a thread */
+extern _Thread_local vm_t *vm;
 
+void
+vm_init(vm_t *context);
+void
+free_vm(vm_t *context);
+vm_t *EMSCRIPTEN_KEEPALIVE
+new_vm(void);
 void EMSCRIPTEN_KEEPALIVE
-vm_init(void);
-void EMSCRIPTEN_KEEPALIVE
-free_vm(void);
+delete_vm(vm_t *context);
 
 interpret_result EMSCRIPTEN_KEEPALIVE
-interpret(const char *chunk);
+interpret(vm_t *context, const char *chunk);
+interpret_result
+interpret_bytecode(vm_t *context, const char *path);
+interpret_result
+interpret_file(vm_t *context, const char *path);
+
+int
+global_index(obj_string *name);
+const char *
+native_name(native_fn function);
+native_fn
+find_native(const char *name, int length);
 
 void
 push(value_t);